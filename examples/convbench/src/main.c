@@ -0,0 +1,156 @@
+/* convbench: measures the speed of img_convert for every pair of pixel formats
+ * usage: convbench [-s size] [-r repeats] [-t threads]
+ * converts a size x size image (1024x1024 by default) with noisy content, and
+ * prints a table of megapixels per second, source formats down the side,
+ * destination formats across the top. The times include allocating the new
+ * pixels, for conversions to larger pixels.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <imago2.h>
+
+static const char *fmtname[] = {
+	"grey8", "rgb24", "rgba32", "greyf", "rgbf", "rgbaf", "bgra32", "rgb565", "idx8"
+};
+
+static int gen_image(struct img_pixmap *img, int xsz, int ysz);
+static double get_msec(void);
+
+
+int main(int argc, char **argv)
+{
+	int i, j, k, size = 1024, repeats = 5, nthreads = 0;
+	double t0, best;
+	struct img_pixmap orig, src, dest;
+
+	for(i=1; i<argc; i++) {
+		if(argv[i][0] == '-' && argv[i][1] && argv[i][2] == 0) {
+			switch(argv[i][1]) {
+			case 's':
+				if(!argv[++i] || (size = atoi(argv[i])) < 1) {
+					fprintf(stderr, "-s must be followed by the image size\n");
+					return 1;
+				}
+				break;
+
+			case 'r':
+				if(!argv[++i] || (repeats = atoi(argv[i])) < 1) {
+					fprintf(stderr, "-r must be followed by a number of repeats\n");
+					return 1;
+				}
+				break;
+
+			case 't':
+				if(!argv[++i] || (nthreads = atoi(argv[i])) < 0) {
+					fprintf(stderr, "-t must be followed by a number of threads (0: one per CPU)\n");
+					return 1;
+				}
+				break;
+
+			case 'h':
+				printf("Usage: %s [-s size] [-r repeats] [-t threads]\n", argv[0]);
+				return 0;
+
+			default:
+				fprintf(stderr, "invalid option: %s\n", argv[i]);
+				return 1;
+			}
+		} else {
+			fprintf(stderr, "invalid argument: %s\n", argv[i]);
+			return 1;
+		}
+	}
+
+	img_set_num_threads(nthreads);
+
+	img_init(&orig);
+	if(gen_image(&orig, size, size) == -1) {
+		fprintf(stderr, "failed to generate test image\n");
+		return 1;
+	}
+
+	printf("%dx%d image, %d threads, best of %d runs, megapixels per second\n", size, size,
+			img_get_num_threads(), repeats);
+	printf("%-8s", "");
+	for(j=0; j<IMG_FMT_IDX8; j++) {
+		printf(" %8s", fmtname[j]);
+	}
+	putchar('\n');
+
+	for(i=0; i<NUM_IMG_FMT; i++) {
+		img_init(&src);
+		if(img_copy(&src, &orig) == -1 || img_convert(&src, i) == -1) {
+			fprintf(stderr, "failed to convert the test image to %s\n", fmtname[i]);
+			return 1;
+		}
+		printf("%-8s", fmtname[i]);
+
+		/* conversions to idx8 are quantization, see quantbench */
+		for(j=0; j<IMG_FMT_IDX8; j++) {
+			if(i == j) {
+				printf(" %8s", "-");
+				continue;
+			}
+
+			best = 0;
+			for(k=0; k<repeats; k++) {
+				img_init(&dest);
+				if(img_copy(&dest, &src) == -1) {
+					fprintf(stderr, "failed to copy image\n");
+					return 1;
+				}
+
+				t0 = get_msec();
+				if(img_convert(&dest, j) == -1) {
+					fprintf(stderr, "failed to convert %s -> %s\n", fmtname[i], fmtname[j]);
+					return 1;
+				}
+				t0 = get_msec() - t0;
+				if(k == 0 || t0 < best) best = t0;
+				img_destroy(&dest);
+			}
+
+			printf(" %8.0f", best > 0.0 ? (double)size * size / (best * 1000.0) : 0.0);
+			fflush(stdout);
+		}
+		putchar('\n');
+		img_destroy(&src);
+	}
+
+	img_destroy(&orig);
+	return 0;
+}
+
+/* smooth gradients with noise and a translucent alpha channel, so that no
+ * conversion gets to take shortcuts
+ */
+static int gen_image(struct img_pixmap *img, int xsz, int ysz)
+{
+	int i, j;
+	unsigned char *pix;
+
+	if(img_set_pixels(img, xsz, ysz, IMG_FMT_RGBA32, 0) == -1) {
+		return -1;
+	}
+
+	pix = img->pixels;
+	for(i=0; i<ysz; i++) {
+		for(j=0; j<xsz; j++) {
+			pix[0] = (j * 255 / xsz + (rand() & 15)) & 0xff;
+			pix[1] = (i * 255 / ysz + (rand() & 15)) & 0xff;
+			pix[2] = ((i ^ j) >> 3) & 0xff;
+			pix[3] = 128 + (rand() & 127);
+			pix += 4;
+		}
+	}
+	return 0;
+}
+
+static double get_msec(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, 0);
+	return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
@@ -0,0 +1,179 @@
+/* quantbench: compares the speed and quality of the img_quantize quantizers
+ * usage: quantbench [-n colors] [-r repeats] [image]
+ * without an image, a synthetic 2048x2048 test image is used.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <imago2.h>
+
+struct config {
+	const char *name;
+	enum img_quantizer method;
+	int iter;
+};
+
+static struct config configs[] = {
+	{"octree", IMG_QUANT_OCTREE, 0},
+	{"octree + 4 k-means", IMG_QUANT_OCTREE, 4},
+	{"median cut", IMG_QUANT_MEDIAN_CUT, 0},
+	{"median cut + 2 k-means", IMG_QUANT_MEDIAN_CUT, 2},
+	{"median cut + 4 k-means", IMG_QUANT_MEDIAN_CUT, 4},
+	{"median cut + 16 k-means", IMG_QUANT_MEDIAN_CUT, 16},
+	{0}
+};
+
+static int gen_image(struct img_pixmap *img, int xsz, int ysz);
+static double mean_sq_error(struct img_pixmap *orig, struct img_pixmap *quant);
+static double get_msec(void);
+
+
+int main(int argc, char **argv)
+{
+	const char *infile = 0;
+	int i, j, ncolors = 256, repeats = 3;
+	double t0, best;
+	struct img_pixmap orig, img;
+	struct config *cfg;
+
+	for(i=1; i<argc; i++) {
+		if(argv[i][0] == '-' && argv[i][2] == 0) {
+			switch(argv[i][1]) {
+			case 'n':
+				if(!argv[++i] || (ncolors = atoi(argv[i])) < 2 || ncolors > 256) {
+					fprintf(stderr, "-n must be followed by a number of colors (2-256)\n");
+					return 1;
+				}
+				break;
+
+			case 'r':
+				if(!argv[++i] || (repeats = atoi(argv[i])) < 1) {
+					fprintf(stderr, "-r must be followed by a number of repeats\n");
+					return 1;
+				}
+				break;
+
+			case 'h':
+				printf("Usage: %s [-n colors] [-r repeats] [image]\n", argv[0]);
+				return 0;
+
+			default:
+				fprintf(stderr, "invalid option: %s\n", argv[i]);
+				return 1;
+			}
+		} else {
+			if(infile) {
+				fprintf(stderr, "invalid argument: %s\n", argv[i]);
+				return 1;
+			}
+			infile = argv[i];
+		}
+	}
+
+	img_init(&orig);
+	if(infile) {
+		if(img_load(&orig, infile) == -1) {
+			fprintf(stderr, "failed to load image: %s\n", infile);
+			return 1;
+		}
+	} else {
+		if(gen_image(&orig, 2048, 2048) == -1) {
+			fprintf(stderr, "failed to generate test image\n");
+			return 1;
+		}
+	}
+	if(img_convert(&orig, IMG_FMT_RGB24) == -1) {
+		fprintf(stderr, "failed to convert image to RGB24\n");
+		return 1;
+	}
+
+	printf("%dx%d image, %d colors, best of %d runs\n", orig.width, orig.height, ncolors, repeats);
+	printf("%-26s %10s %10s\n", "quantizer", "time (ms)", "MSE");
+
+	for(cfg=configs; cfg->name; cfg++) {
+		img_set_quantizer(cfg->method, cfg->iter);
+
+		best = 0;
+		img_init(&img);
+		for(j=0; j<repeats; j++) {
+			img_destroy(&img);
+			img_init(&img);
+			if(img_copy(&img, &orig) == -1) {
+				fprintf(stderr, "failed to copy image\n");
+				return 1;
+			}
+
+			t0 = get_msec();
+			if(img_quantize(&img, ncolors, IMG_DITHER_NONE) == -1) {
+				fprintf(stderr, "%s: failed to quantize image\n", cfg->name);
+				return 1;
+			}
+			t0 = get_msec() - t0;
+			if(j == 0 || t0 < best) best = t0;
+		}
+
+		printf("%-26s %10.1f %10.2f\n", cfg->name, best, mean_sq_error(&orig, &img));
+		img_destroy(&img);
+	}
+
+	img_destroy(&orig);
+	return 0;
+}
+
+/* smooth gradients with some noise and a few flat areas, for lack of a photo */
+static int gen_image(struct img_pixmap *img, int xsz, int ysz)
+{
+	int i, j;
+	unsigned char *pix;
+
+	if(img_set_pixels(img, xsz, ysz, IMG_FMT_RGB24, 0) == -1) {
+		return -1;
+	}
+
+	pix = img->pixels;
+	for(i=0; i<ysz; i++) {
+		for(j=0; j<xsz; j++) {
+			if(((i >> 7) & 3) == 0 && ((j >> 7) & 3) == 0) {
+				pix[0] = 200;
+				pix[1] = 40;
+				pix[2] = 60;
+			} else {
+				pix[0] = j * 255 / xsz;
+				pix[1] = (i * 255 / ysz + (rand() & 15)) & 0xff;
+				pix[2] = ((i ^ j) >> 3) & 0xff;
+			}
+			pix += 3;
+		}
+	}
+	return 0;
+}
+
+static double mean_sq_error(struct img_pixmap *orig, struct img_pixmap *quant)
+{
+	int i, j, dr, dg, db;
+	double sum = 0.0;
+	unsigned char *src, *idx;
+	struct img_colormap *cmap = img_colormap(quant);
+
+	for(i=0; i<orig->height; i++) {
+		src = (unsigned char*)orig->pixels + (size_t)i * orig->pitch;
+		idx = (unsigned char*)quant->pixels + (size_t)i * quant->pitch;
+		for(j=0; j<orig->width; j++) {
+			dr = src[0] - cmap->color[*idx].r;
+			dg = src[1] - cmap->color[*idx].g;
+			db = src[2] - cmap->color[*idx].b;
+			sum += dr * dr + dg * dg + db * db;
+			src += 3;
+			idx++;
+		}
+	}
+	return sum / ((double)orig->width * orig->height);
+}
+
+static double get_msec(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, 0);
+	return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
@@ -0,0 +1,165 @@
+/*
+libimago - a multi-format image file input/output library.
+Copyright (C) 2010-2026 John Tsiombikas <nuclear@mutantstargoat.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* memory allocation hooks */
+#include <stdlib.h>
+#include <string.h>
+#include "imago2.h"
+#include "alloc.h"
+#include "byteord.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define USE_POSIX_MEMALIGN
+#elif defined(_WIN32)
+#define USE_ALIGNED_MALLOC
+#include <malloc.h>
+#endif
+
+/* alignment we can count on from malloc */
+#define MALLOC_ALIGN	(2 * sizeof(void*))
+
+static void *def_alloc(size_t sz, size_t align, void *cls);
+static void *def_realloc(void *ptr, size_t sz, size_t align, void *cls);
+static void def_free(void *ptr, void *cls);
+
+static void *(*alloc_func)(size_t, size_t, void*) = def_alloc;
+static void *(*realloc_func)(void*, size_t, size_t, void*) = def_realloc;
+static void (*free_func)(void*, void*) = def_free;
+static void *alloc_cls;
+static size_t pix_align;
+
+
+void img_set_allocator(void *(*allocfn)(size_t, size_t, void*),
+		void *(*reallocfn)(void*, size_t, size_t, void*),
+		void (*freefn)(void*, void*), void *cls)
+{
+	if(!allocfn || !reallocfn || !freefn) {
+		alloc_func = def_alloc;
+		realloc_func = def_realloc;
+		free_func = def_free;
+		alloc_cls = 0;
+	} else {
+		alloc_func = allocfn;
+		realloc_func = reallocfn;
+		free_func = freefn;
+		alloc_cls = cls;
+	}
+}
+
+int img_set_pixel_alignment(int align)
+{
+	if(align < 0 || (align & (align - 1))) {
+		return -1;
+	}
+	pix_align = align;
+	return 0;
+}
+
+void *img_mem_alloc(size_t sz)
+{
+	return alloc_func(sz, 0, alloc_cls);
+}
+
+void *img_mem_realloc(void *ptr, size_t sz)
+{
+	return realloc_func(ptr, sz, 0, alloc_cls);
+}
+
+void img_mem_free(void *ptr)
+{
+	if(ptr) {
+		free_func(ptr, alloc_cls);
+	}
+}
+
+void *img_pixbuf_alloc(size_t sz)
+{
+	return alloc_func(sz, pix_align, alloc_cls);
+}
+
+void *img_pixbuf_realloc(void *ptr, size_t sz)
+{
+	return realloc_func(ptr, sz, pix_align, alloc_cls);
+}
+
+
+#ifdef USE_ALIGNED_MALLOC
+/* everything goes through _aligned_malloc, so that it can all be freed the same way */
+static void *def_alloc(size_t sz, size_t align, void *cls)
+{
+	return _aligned_malloc(sz, align > MALLOC_ALIGN ? align : MALLOC_ALIGN);
+}
+
+static void *def_realloc(void *ptr, size_t sz, size_t align, void *cls)
+{
+	return _aligned_realloc(ptr, sz, align > MALLOC_ALIGN ? align : MALLOC_ALIGN);
+}
+
+static void def_free(void *ptr, void *cls)
+{
+	_aligned_free(ptr);
+}
+
+#else	/* !USE_ALIGNED_MALLOC */
+
+static void *def_alloc(size_t sz, size_t align, void *cls)
+{
+#ifdef USE_POSIX_MEMALIGN
+	void *ptr;
+
+	if(align > MALLOC_ALIGN) {
+		return posix_memalign(&ptr, align, sz) == 0 ? ptr : 0;
+	}
+#endif
+	/* without posix_memalign, only a user allocator can do better than this */
+	return malloc(sz);
+}
+
+static void *def_realloc(void *ptr, size_t sz, size_t align, void *cls)
+{
+#ifdef USE_POSIX_MEMALIGN
+	void *newptr, *aligned;
+
+	if(align > MALLOC_ALIGN) {
+		/* realloc doesn't keep the alignment, so have an aligned block ready in
+		 * case it moves the data somewhere else. If anything fails, ptr is intact.
+		 */
+		if(posix_memalign(&aligned, align, sz) != 0) {
+			return 0;
+		}
+		if(!(newptr = realloc(ptr, sz))) {
+			free(aligned);
+			return 0;
+		}
+		if((uintptr_t)newptr & (align - 1)) {
+			memcpy(aligned, newptr, sz);
+			free(newptr);
+			return aligned;
+		}
+		free(aligned);
+		return newptr;
+	}
+#endif
+	return realloc(ptr, sz);
+}
+
+static void def_free(void *ptr, void *cls)
+{
+	free(ptr);
+}
+#endif	/* !USE_ALIGNED_MALLOC */
@@ -0,0 +1,36 @@
+/*
+libimago - a multi-format image file input/output library.
+Copyright (C) 2010-2026 John Tsiombikas <nuclear@mutantstargoat.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef IMAGO_ALLOC_H_
+#define IMAGO_ALLOC_H_
+
+#include <stddef.h>
+
+/* internal memory allocation functions, going through the allocator hooks set
+ * with img_set_allocator. Everything allocated with either of these is freed
+ * with img_mem_free.
+ */
+void *img_mem_alloc(size_t sz);
+void *img_mem_realloc(void *ptr, size_t sz);
+void img_mem_free(void *ptr);
+
+/* same as above, for pixel buffers, aligned to the pixel alignment */
+void *img_pixbuf_alloc(size_t sz);
+void *img_pixbuf_realloc(void *ptr, size_t sz);
+
+#endif	/* IMAGO_ALLOC_H_ */
@@ -15,436 +15,457 @@ GNU Lesser General Public License for more details.
 You should have received a copy of the GNU Lesser General Public License
 along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
+#include <stdlib.h>
 #include <string.h>
-#if defined(__WATCOMC__) || defined(WIN32) || defined(MSDOS)
-#include <malloc.h>
-#else
-#ifndef __FreeBSD__
-#include <alloca.h>
-#endif
-#endif
+#include <limits.h>
+#include <assert.h>
 #include "imago2.h"
+#include "conv.h"
+#include "thrpool.h"
+#include "alloc.h"
 #include "inttypes.h"
 
-/* pixel-format conversions are sub-optimal at the moment to avoid
- * writing a lot of code. optimize at some point ?
+/* Every (source, destination) format pair has a direct conversion kernel,
+ * generated below from the per-format load/store macros. Conversions between
+ * 8bit integer formats never leave the integer domain; anything involving a
+ * floating point format goes through floats. The only destination without
+ * kernels is IMG_FMT_IDX8, which needs a palette, see img_convert.
+ * The hottest pairs also have SIMD versions in conv_simd.c, which take over
+ * the bulk of each run of pixels, leaving the remainder to the scalar kernels.
  */
 
 #define CLAMP(x, a, b)	((x) < (a) ? (a) : ((x) > (b) ? (b) : (x)))
 
-struct pixel {
-	float r, g, b, a;
-};
+/* float to n-bit channel value: truncate after scaling, clamped to [0, max] (NaN -> 0) */
+#define FTON(x, max)	((x) > 0.0f ? ((x) < 1.0f ? (int)((x) * (float)(max)) : (max)) : 0)
+#define FTOB(x)	FTON(x, 255)
+#define BTOF(x)	((float)(x) / 255.0f)
+
+/* per-format pixel sizes and floating point flags */
+#define PSZ_grey8	1
+#define PSZ_rgb24	3
+#define PSZ_rgba32	4
+#define PSZ_greyf	sizeof(float)
+#define PSZ_rgbf	(3 * sizeof(float))
+#define PSZ_rgbaf	(4 * sizeof(float))
+#define PSZ_bgra32	4
+#define PSZ_rgb565	2
+#define PSZ_idx8	1
+
+#define FLT_grey8	0
+#define FLT_rgb24	0
+#define FLT_rgba32	0
+#define FLT_greyf	1
+#define FLT_rgbf	1
+#define FLT_rgbaf	1
+#define FLT_bgra32	0
+#define FLT_rgb565	0
+#define FLT_idx8	0
+
+/* LDI_x: load a pixel into the integer r, g, b, a variables [0, 255]
+ * LDF_x: load a pixel into the float fr, fg, fb, fa variables
+ */
+#define LDI_grey8(p)	(r = g = b = (p)[0], a = 255)
+#define LDI_rgb24(p)	(r = (p)[0], g = (p)[1], b = (p)[2], a = 255)
+#define LDI_rgba32(p)	(r = (p)[0], g = (p)[1], b = (p)[2], a = (p)[3])
+#define LDI_bgra32(p)	(b = (p)[0], g = (p)[1], r = (p)[2], a = (p)[3])
+#define LDI_rgb565(p)	(unpack565(*(uint16_t*)(p), &r, &g, &b), a = 255)
+#define LDI_idx8(p)		lookup_cmap(cmap, *(p), &r, &g, &b, &a)
+#define LDI_greyf(p)	(LDF_greyf(p), r = FTOB(fr), g = FTOB(fg), b = FTOB(fb), a = 255)
+#define LDI_rgbf(p)		(LDF_rgbf(p), r = FTOB(fr), g = FTOB(fg), b = FTOB(fb), a = 255)
+#define LDI_rgbaf(p)	(LDF_rgbaf(p), r = FTOB(fr), g = FTOB(fg), b = FTOB(fb), a = FTOB(fa))
+
+#define LDF_grey8(p)	(fr = fg = fb = BTOF((p)[0]), fa = 1.0f)
+#define LDF_rgb24(p)	(LDI_rgb24(p), ITOF())
+#define LDF_rgba32(p)	(LDI_rgba32(p), ITOF())
+#define LDF_bgra32(p)	(LDI_bgra32(p), ITOF())
+#define LDF_rgb565(p)	(LDI_rgb565(p), ITOF())
+#define LDF_idx8(p)		(LDI_idx8(p), ITOF())
+#define LDF_greyf(p)	(fr = fg = fb = ((float*)(p))[0], fa = 1.0f)
+#define LDF_rgbf(p)		(fr = ((float*)(p))[0], fg = ((float*)(p))[1], fb = ((float*)(p))[2], fa = 1.0f)
+#define LDF_rgbaf(p)	(fr = ((float*)(p))[0], fg = ((float*)(p))[1], fb = ((float*)(p))[2], fa = ((float*)(p))[3])
+
+#define ITOF()	(fr = BTOF(r), fg = BTOF(g), fb = BTOF(b), fa = BTOF(a))
+
+/* STI_x: store a pixel from the integer r, g, b, a variables
+ * STF_x: store a pixel from the float fr, fg, fb, fa variables
+ */
+#define STI_grey8(p)	((p)[0] = (r + g + b) / 3)
+#define STI_rgb24(p)	((p)[0] = r, (p)[1] = g, (p)[2] = b)
+#define STI_rgba32(p)	((p)[0] = r, (p)[1] = g, (p)[2] = b, (p)[3] = a)
+#define STI_bgra32(p)	((p)[0] = b, (p)[1] = g, (p)[2] = r, (p)[3] = a)
+#define STI_rgb565(p)	(*(uint16_t*)(p) = ((r * 31 / 255) << 11) | ((g * 63 / 255) << 5) | (b * 31 / 255))
+#define STI_greyf(p)	(ITOF(), STF_greyf(p))
+#define STI_rgbf(p)		(ITOF(), STF_rgbf(p))
+#define STI_rgbaf(p)	(ITOF(), STF_rgbaf(p))
+
+#define STF_grey8(p)	((p)[0] = FTOB((fr + fg + fb) / 3.0f))
+#define STF_rgb24(p)	(FTOI(), STI_rgb24(p))
+#define STF_rgba32(p)	(FTOI(), STI_rgba32(p))
+#define STF_bgra32(p)	(FTOI(), STI_bgra32(p))
+#define STF_rgb565(p)	(*(uint16_t*)(p) = (FTON(fr, 31) << 11) | (FTON(fg, 63) << 5) | FTON(fb, 31))
+#define STF_greyf(p)	(((float*)(p))[0] = (fr + fg + fb) / 3.0f)
+#define STF_rgbf(p)		(((float*)(p))[0] = fr, ((float*)(p))[1] = fg, ((float*)(p))[2] = fb)
+#define STF_rgbaf(p)	(((float*)(p))[0] = fr, ((float*)(p))[1] = fg, ((float*)(p))[2] = fb, ((float*)(p))[3] = fa)
+
+#define FTOI()	(r = FTOB(fr), g = FTOB(fg), b = FTOB(fb), a = FTOB(fa))
+
+/* generates the conversion kernel conv_<src>_<dst>. Both sides of the
+ * float/integer test are constant, so only one of them survives compilation.
+ */
+#define DEF_CONV(dfmt, sfmt) \
+static void conv_##sfmt##_##dfmt(void *dptr, void *sptr, int count, struct img_colormap *cmap) \
+{ \
+	int i, r, g, b, a; \
+	float fr, fg, fb, fa; \
+	unsigned char *sp = sptr, *dp = dptr; \
+	for(i=0; i<count; i++) { \
+		if(FLT_##sfmt || FLT_##dfmt) { \
+			LDF_##sfmt(sp); \
+			STF_##dfmt(dp); \
+		} else { \
+			LDI_##sfmt(sp); \
+			STI_##dfmt(dp); \
+		} \
+		sp += PSZ_##sfmt; \
+		dp += PSZ_##dfmt; \
+	} \
+	(void)a; (void)fa;	/* alpha is dropped by some destination formats */ \
+}
 
-static void unpack_grey8(struct pixel *unp, void *pptr, int count, struct img_colormap *cmap);
-static void unpack_rgb24(struct pixel *unp, void *pptr, int count, struct img_colormap *cmap);
-static void unpack_rgba32(struct pixel *unp, void *pptr, int count, struct img_colormap *cmap);
-static void unpack_bgra32(struct pixel *unp, void *pptr, int count, struct img_colormap *cmap);
-static void unpack_greyf(struct pixel *unp, void *pptr, int count, struct img_colormap *cmap);
-static void unpack_rgbf(struct pixel *unp, void *pptr, int count, struct img_colormap *cmap);
-static void unpack_rgbaf(struct pixel *unp, void *pptr, int count, struct img_colormap *cmap);
-static void unpack_rgb565(struct pixel *unp, void *pptr, int count, struct img_colormap *cmap);
-static void unpack_idx8(struct pixel *unp, void *pptr, int count, struct img_colormap *cmap);
-
-static void pack_grey8(void *pptr, struct pixel *unp, int count);
-static void pack_rgb24(void *pptr, struct pixel *unp, int count);
-static void pack_rgba32(void *pptr, struct pixel *unp, int count);
-static void pack_bgra32(void *pptr, struct pixel *unp, int count);
-static void pack_greyf(void *pptr, struct pixel *unp, int count);
-static void pack_rgbf(void *pptr, struct pixel *unp, int count);
-static void pack_rgbaf(void *pptr, struct pixel *unp, int count);
-static void pack_rgb565(void *pptr, struct pixel *unp, int count);
-
-/* XXX keep in sync with enum img_fmt at imago2.h */
-static void (*unpack[])(struct pixel*, void*, int, struct img_colormap*) = {
-	unpack_grey8,
-	unpack_rgb24,
-	unpack_rgba32,
-	unpack_greyf,
-	unpack_rgbf,
-	unpack_rgbaf,
-	unpack_bgra32,
-	unpack_rgb565,
-	unpack_idx8
+/* all formats we can convert to, in enum img_fmt order. IMG_FMT_IDX8 is the
+ * last format, and conversions to it go through img_quantize instead.
+ * XXX keep in sync with enum img_fmt at imago2.h
+ */
+#define DST_FMT_LIST(X, arg) \
+	X(grey8, arg) X(rgb24, arg) X(rgba32, arg) X(greyf, arg) X(rgbf, arg) \
+	X(rgbaf, arg) X(bgra32, arg) X(rgb565, arg)
+#define FMT_LIST(X, arg) \
+	DST_FMT_LIST(X, arg) X(idx8, arg)
+
+static void unpack565(uint16_t p, int *r, int *g, int *b);
+static void lookup_cmap(struct img_colormap *cmap, int idx, int *r, int *g, int *b, int *a);
+
+/* one row of kernels per source format */
+#define DEF_CONV_ROW(sfmt)	DST_FMT_LIST(DEF_CONV, sfmt)
+DEF_CONV_ROW(grey8)
+DEF_CONV_ROW(rgb24)
+DEF_CONV_ROW(rgba32)
+DEF_CONV_ROW(greyf)
+DEF_CONV_ROW(rgbf)
+DEF_CONV_ROW(rgbaf)
+DEF_CONV_ROW(bgra32)
+DEF_CONV_ROW(rgb565)
+DEF_CONV_ROW(idx8)
+
+#define CONV_ENTRY(dfmt, sfmt)	conv_##sfmt##_##dfmt,
+#define CONV_ROW(sfmt)	{ DST_FMT_LIST(CONV_ENTRY, sfmt) 0 }
+
+/* XXX keep the rows in sync with enum img_fmt at imago2.h */
+static conv_func conv[][NUM_IMG_FMT] = {
+	CONV_ROW(grey8),
+	CONV_ROW(rgb24),
+	CONV_ROW(rgba32),
+	CONV_ROW(greyf),
+	CONV_ROW(rgbf),
+	CONV_ROW(rgbaf),
+	CONV_ROW(bgra32),
+	CONV_ROW(rgb565),
+	CONV_ROW(idx8)
 };
 
-/* XXX keep in sync with enum img_fmt at imago2.h */
-static void (*pack[])(void*, struct pixel*, int) = {
-	pack_grey8,
-	pack_rgb24,
-	pack_rgba32,
-	pack_greyf,
-	pack_rgbf,
-	pack_rgbaf,
-	pack_bgra32,
-	pack_rgb565,
-	0
+/* large images are converted in bands of rows on multiple threads, as long as
+ * each band gets at least this many pixels
+ */
+#define MT_MIN_PIXELS	65536
+
+struct conv_job {
+	unsigned char *sptr, *dptr;
+	int width, spsz, dpsz, spitch, dpitch;
+	conv_func kernel;
+	simd_conv_func simd_kernel;
+	struct img_colormap *cmap;
 };
 
+static int conv_num_bands(struct img_pixmap *img, enum img_fmt tofmt);
+static void conv_pixels(void *dpix, int dpitch, enum img_fmt tofmt, struct img_pixmap *img, int nbands);
+static void conv_band(void *cls, int band, int start, int end);
+
+/* fail to compile if the tables went out of sync with enum img_fmt */
+typedef char conv_table_size_check[sizeof conv / sizeof *conv == NUM_IMG_FMT ? 1 : -1];
+
 
 int img_convert(struct img_pixmap *img, enum img_fmt tofmt)
 {
-	struct pixel pbuf[8];
-	int bufsz = (img->width & 7) == 0 ? 8 : ((img->width & 3) == 0 ? 4 : 1);
-	int i, num_pix = img->width * img->height;
-	int num_iter = num_pix / bufsz;
-	char *sptr, *dptr;
-	struct img_pixmap nimg;
-	struct img_colormap *cmap = img_colormap(img);
+	int nbands, dpsz, dpitch;
+	void *newpix;
 
 	if(img->fmt == tofmt) {
 		return 0;	/* nothing to do */
 	}
+	if((unsigned int)tofmt >= NUM_IMG_FMT) {
+		return -1;
+	}
 
 	if(tofmt == IMG_FMT_IDX8) {
 		return img_quantize(img, 256, 0);
 	}
 
-	img_init(&nimg);
-	if(img_set_pixels(&nimg, img->width, img->height, tofmt, 0) == -1) {
-		img_destroy(&nimg);
+	dpsz = img_pixel_size(tofmt);
+	nbands = conv_num_bands(img, tofmt);
+
+	/* All kernels read each pixel (or block of pixels) before writing the
+	 * result, so if the destination pixels are not larger than the source
+	 * pixels, we can convert in place. When shrinking, each band writes over
+	 * the source pixels of the bands before it, so that only works serially.
+	 * Same-size conversions keep the pitch, otherwise the result is packed.
+	 * Borrowed buffers (views etc) are never written to, we just stop using them.
+	 */
+	if(img->width > INT_MAX / dpsz) {
 		return -1;
 	}
-
-	sptr = img->pixels;
-	dptr = nimg.pixels;
-
-	for(i=0; i<num_iter; i++) {
-		unpack[img->fmt](pbuf, sptr, bufsz, cmap);
-		pack[tofmt](dptr, pbuf, bufsz);
-
-		sptr += bufsz * img->pixelsz;
-		dptr += bufsz * nimg.pixelsz;
-	}
-
-	img_copy(img, &nimg);
-	img_destroy(&nimg);
-	return 0;
-}
-
-/* the following functions *could* benefit from SIMD */
-
-static void unpack_grey8(struct pixel *unp, void *pptr, int count, struct img_colormap *cmap)
-{
-	int i;
-	unsigned char *pix = pptr;
-
-	for(i=0; i<count; i++) {
-		unp->r = unp->g = unp->b = (float)*pix++ / 255.0;
-		unp->a = 1.0;
-		unp++;
-	}
-}
-
-static void unpack_rgb24(struct pixel *unp, void *pptr, int count, struct img_colormap *cmap)
-{
-	int i;
-	unsigned char *pix = pptr;
-
-	for(i=0; i<count; i++) {
-		unp->r = (float)*pix++ / 255.0;
-		unp->g = (float)*pix++ / 255.0;
-		unp->b = (float)*pix++ / 255.0;
-		unp->a = 1.0;
-		unp++;
+	dpitch = img->width * dpsz;
+	if(!(img->flags & IMG_BORROWED) && dpsz == img->pixelsz) {
+		newpix = img->pixels;
+		dpitch = img->pitch;
+	} else if(!(img->flags & IMG_BORROWED) && dpsz < img->pixelsz && nbands <= 1) {
+		newpix = img->pixels;
+	} else {
+		if(!(newpix = img_pixbuf_alloc((size_t)img->height * dpitch))) {
+			return -1;
+		}
 	}
-}
 
-static void unpack_rgba32(struct pixel *unp, void *pptr, int count, struct img_colormap *cmap)
-{
-	int i;
-	unsigned char *pix = pptr;
-
-	for(i=0; i<count; i++) {
-		unp->r = (float)*pix++ / 255.0;
-		unp->g = (float)*pix++ / 255.0;
-		unp->b = (float)*pix++ / 255.0;
-		unp->a = (float)*pix++ / 255.0;
-		unp++;
-	}
-}
+	conv_pixels(newpix, dpitch, tofmt, img, nbands);
 
-static void unpack_bgra32(struct pixel *unp, void *pptr, int count, struct img_colormap *cmap)
-{
-	int i;
-	unsigned char *pix = pptr;
-
-	for(i=0; i<count; i++) {
-		unp->a = (float)*pix++ / 255.0;
-		unp->r = (float)*pix++ / 255.0;
-		unp->g = (float)*pix++ / 255.0;
-		unp->b = (float)*pix++ / 255.0;
-		unp++;
+	if(newpix != img->pixels) {
+		img_release_pixels(img);
+		img->pixels = newpix;
+	} else if(!img->release && img->height > 0 && dpitch > 0 &&
+			(dpitch < img->pitch || img->fmt == IMG_FMT_IDX8)) {
+		/* give back the space we don't need anymore (including the colormap) */
+		if((newpix = img_pixbuf_realloc(img->pixels, (size_t)img->height * dpitch))) {
+			img->pixels = newpix;
+		}
 	}
+	img->fmt = tofmt;
+	img->pixelsz = dpsz;
+	img->pitch = dpitch;
+	return 0;
 }
 
-static void unpack_greyf(struct pixel *unp, void *pptr, int count, struct img_colormap *cmap)
+int img_convert_into(struct img_pixmap *dest, struct img_pixmap *src)
 {
 	int i;
-	float *pix = pptr;
 
-	for(i=0; i<count; i++) {
-		unp->r = unp->g = unp->b = *pix++;
-		unp->a = 1.0;
-		unp++;
-	}
-}
-
-static void unpack_rgbf(struct pixel *unp, void *pptr, int count, struct img_colormap *cmap)
-{
-	int i;
-	float *pix = pptr;
-
-	for(i=0; i<count; i++) {
-		unp->r = *pix++;
-		unp->g = *pix++;
-		unp->b = *pix++;
-		unp->a = 1.0;
-		unp++;
+	if(dest->width != src->width || dest->height != src->height || dest->fmt == IMG_FMT_IDX8) {
+		return -1;
 	}
-}
 
-static void unpack_rgbaf(struct pixel *unp, void *pptr, int count, struct img_colormap *cmap)
-{
-	int i;
-	float *pix = pptr;
-
-	for(i=0; i<count; i++) {
-		unp->r = *pix++;
-		unp->g = *pix++;
-		unp->b = *pix++;
-		unp->a = *pix++;
-		unp++;
+	if(dest->fmt == src->fmt) {
+		for(i=0; i<src->height; i++) {
+			memcpy((char*)dest->pixels + (size_t)i * dest->pitch, (char*)src->pixels + (size_t)i * src->pitch,
+					src->width * src->pixelsz);
+		}
+		return 0;
 	}
-}
 
-static void unpack_rgb565(struct pixel *unp, void *pptr, int count, struct img_colormap *cmap)
-{
-	int i;
-	uint16_t *pix = pptr;
-
-	for(i=0; i<count; i++) {
-		uint16_t r, g, b, p = *pix++;
-		b = (p & 0x1f) << 3;
-		if(b & 8) b |= 7;	/* fill LSbits with whatever bit 0 was */
-		g = (p >> 2) & 0xfc;
-		if(g & 4) g |= 3;	/* ditto */
-		r = (p >> 8) & 0xf8;
-		if(r & 8) r |= 7;	/* same */
-
-		unp->r = (float)r / 255.0f;
-		unp->g = (float)g / 255.0f;
-		unp->b = (float)b / 255.0f;
-		unp->a = 1.0f;
-		unp++;
-	}
+	conv_pixels(dest->pixels, dest->pitch, dest->fmt, src, conv_num_bands(src, dest->fmt));
+	return 0;
 }
 
-static void unpack_idx8(struct pixel *unp, void *pptr, int count, struct img_colormap *cmap)
+/* number of bands to split the conversion of img into */
+static int conv_num_bands(struct img_pixmap *img, enum img_fmt tofmt)
 {
-	int i, idx;
-	unsigned char *pix = pptr;
-
-	for(i=0; i<count; i++) {
-		idx = *pix++;
-		if(idx >= cmap->ncolors) {
-			unp->r = unp->g = unp->b = 0;
-		} else {
-			unp->r = (float)cmap->color[idx].r / 255.0f;
-			unp->g = (float)cmap->color[idx].g / 255.0f;
-			unp->b = (float)cmap->color[idx].b / 255.0f;
-		}
-		unp->a = 1.0f;
-		unp++;
+	if(img->width <= 0) {
+		return 1;
 	}
+	return img_num_bands(img->height, MT_MIN_PIXELS / img->width);
 }
 
-
-static void pack_grey8(void *pptr, struct pixel *unp, int count)
+/* converts the pixels of img to tofmt, writing them to dpix, with dpitch bytes
+ * per row (possibly in place, see img_convert).
+ */
+static void conv_pixels(void *dpix, int dpitch, enum img_fmt tofmt, struct img_pixmap *img, int nbands)
 {
-	int i;
-	unsigned char *pix = pptr;
-
-	for(i=0; i<count; i++) {
-		int lum = (int)(255.0 * (unp->r + unp->g + unp->b) / 3.0);
-		*pix++ = CLAMP(lum, 0, 255);
-		unp++;
-	}
+	struct conv_job job;
+
+	job.kernel = conv[img->fmt][tofmt];
+	assert(job.kernel);
+	job.sptr = img->pixels;
+	job.dptr = dpix;
+	job.width = img->width;
+	job.spsz = img->pixelsz;
+	job.dpsz = img_pixel_size(tofmt);
+	job.spitch = img->pitch;
+	job.dpitch = dpitch;
+	job.simd_kernel = img_conv_simd(img->fmt, tofmt);
+	job.cmap = img_colormap(img);
+
+	img_parallel_for(img->height, nbands, conv_band, &job);
 }
 
-static void pack_rgb24(void *pptr, struct pixel *unp, int count)
+unsigned char *img_get_row(unsigned char *buf, enum img_fmt tofmt, struct img_pixmap *img, int y)
 {
-	int i;
-	unsigned char *pix = pptr;
+	struct conv_job job;
+	unsigned char *row = (unsigned char*)img->pixels + (size_t)y * img->pitch;
 
-	for(i=0; i<count; i++) {
-		int r = (int)(unp->r * 255.0);
-		int g = (int)(unp->g * 255.0);
-		int b = (int)(unp->b * 255.0);
-
-		*pix++ = CLAMP(r, 0, 255);
-		*pix++ = CLAMP(g, 0, 255);
-		*pix++ = CLAMP(b, 0, 255);
-		unp++;
+	if(img->fmt == tofmt) {
+		return row;
 	}
-}
 
-static void pack_rgba32(void *pptr, struct pixel *unp, int count)
-{
-	int i;
-	unsigned char *pix = pptr;
-
-	for(i=0; i<count; i++) {
-		int r = (int)(unp->r * 255.0);
-		int g = (int)(unp->g * 255.0);
-		int b = (int)(unp->b * 255.0);
-		int a = (int)(unp->a * 255.0);
-
-		*pix++ = CLAMP(r, 0, 255);
-		*pix++ = CLAMP(g, 0, 255);
-		*pix++ = CLAMP(b, 0, 255);
-		*pix++ = CLAMP(a, 0, 255);
-		unp++;
-	}
+	job.kernel = conv[img->fmt][tofmt];
+	assert(job.kernel);
+	job.sptr = row;
+	job.dptr = buf;
+	job.width = img->width;
+	job.spsz = img->pixelsz;
+	job.dpsz = img_pixel_size(tofmt);
+	job.spitch = img->width * img->pixelsz;
+	job.dpitch = img->width * job.dpsz;
+	job.simd_kernel = img_conv_simd(img->fmt, tofmt);
+	job.cmap = img_colormap(img);
+
+	conv_band(&job, 0, 0, 1);
+	return buf;
 }
 
-static void pack_bgra32(void *pptr, struct pixel *unp, int count)
+/* converts rows [start, end) of the image */
+static void conv_band(void *cls, int band, int start, int end)
 {
-	int i;
-	unsigned char *pix = pptr;
-
-	for(i=0; i<count; i++) {
-		int r = (int)(unp->r * 255.0);
-		int g = (int)(unp->g * 255.0);
-		int b = (int)(unp->b * 255.0);
-		int a = (int)(unp->a * 255.0);
-
-		*pix++ = CLAMP(b, 0, 255);
-		*pix++ = CLAMP(g, 0, 255);
-		*pix++ = CLAMP(r, 0, 255);
-		*pix++ = CLAMP(a, 0, 255);
-		unp++;
+	int i, rows, num, n;
+	struct conv_job *job = cls;
+	unsigned char *sptr = job->sptr + (size_t)start * job->spitch;
+	unsigned char *dptr = job->dptr + (size_t)start * job->dpitch;
+	size_t sstep, dstep;
+
+	if(job->width > 0 && job->spitch == job->width * job->spsz && job->dpitch == job->width * job->dpsz) {
+		/* contiguous rows, convert as many in one go as fit in an int, in bytes */
+		rows = INT_MAX / (job->spitch > job->dpitch ? job->spitch : job->dpitch);
+	} else {
+		rows = 1;
 	}
-}
 
-static void pack_greyf(void *pptr, struct pixel *unp, int count)
-{
-	int i;
-	float *pix = pptr;
+	for(i=start; i<end; i+=rows) {
+		unsigned char *sp = sptr, *dp = dptr;
 
-	for(i=0; i<count; i++) {
-		*pix++ = (unp->r + unp->g + unp->b) / 3.0;
-		unp++;
-	}
-}
-
-static void pack_rgbf(void *pptr, struct pixel *unp, int count)
-{
-	int i;
-	float *pix = pptr;
+		if(rows > end - i) {
+			rows = end - i;
+		}
+		num = rows * job->width;
+		sstep = (size_t)rows * job->spitch;
+		dstep = (size_t)rows * job->dpitch;
+
+		if(job->simd_kernel) {
+			n = job->simd_kernel(dp, sp, num);
+			sp += n * job->spsz;
+			dp += n * job->dpsz;
+			num -= n;
+		}
+		job->kernel(dp, sp, num, job->cmap);
 
-	for(i=0; i<count; i++) {
-		*pix++ = unp->r;
-		*pix++ = unp->g;
-		*pix++ = unp->b;
-		unp++;
+		sptr += sstep;
+		dptr += dstep;
 	}
 }
 
-static void pack_rgbaf(void *pptr, struct pixel *unp, int count)
+static void unpack565(uint16_t p, int *r, int *g, int *b)
 {
-	memcpy(pptr, unp, count * sizeof *unp);
+	*b = (p & 0x1f) << 3;
+	if(*b & 8) *b |= 7;	/* fill LSbits with whatever bit 0 was */
+	*g = (p >> 3) & 0xfc;
+	if(*g & 4) *g |= 3;	/* ditto */
+	*r = (p >> 8) & 0xf8;
+	if(*r & 8) *r |= 7;	/* same */
 }
 
-
-static void pack_rgb565(void *pptr, struct pixel *unp, int count)
+static void lookup_cmap(struct img_colormap *cmap, int idx, int *r, int *g, int *b, int *a)
 {
-	int i;
-	uint16_t *pix = pptr;
-
-	for(i=0; i<count; i++) {
-		uint16_t r = (uint16_t)(unp->r * 31.0f);
-		uint16_t g = (uint16_t)(unp->g * 63.0f);
-		uint16_t b = (uint16_t)(unp->b * 31.0f);
-		if(r > 31) r = 31;
-		if(g > 63) g = 63;
-		if(b > 31) b = 31;
-		*pix++ = (r << 11) | (g << 5) | b;
-		unp++;
+	if(idx >= cmap->ncolors) {
+		*r = *g = *b = 0;
+		*a = 255;
+	} else {
+		*r = cmap->color[idx].r;
+		*g = cmap->color[idx].g;
+		*b = cmap->color[idx].b;
+		*a = cmap->alpha[idx];
 	}
 }
 
 void img_vflip(struct img_pixmap *img)
 {
-	char *aptr, *bptr, *tmp;
-	int scansz = img->pixelsz * img->width;
+	char *aptr, *bptr, tmp[1024];
+	int i, sz, scansz = img->pixelsz * img->width;
 
 	if(scansz <= 0 || img->height <= 1) return;
 
-	tmp = alloca(scansz);
 	aptr = img->pixels;
-	bptr = aptr + (img->height - 1) * scansz;
+	bptr = aptr + (size_t)(img->height - 1) * img->pitch;
 
 	while(aptr < bptr) {
-		memcpy(tmp, aptr, scansz);
-		memcpy(aptr, bptr, scansz);
-		memcpy(bptr, tmp, scansz);
-		aptr += scansz;
-		bptr -= scansz;
+		/* swap the two scanlines a piece at a time, they can be huge */
+		for(i=0; i<scansz; i+=sz) {
+			sz = scansz - i < (int)sizeof tmp ? scansz - i : (int)sizeof tmp;
+			memcpy(tmp, aptr + i, sz);
+			memcpy(aptr + i, bptr + i, sz);
+			memcpy(bptr + i, tmp, sz);
+		}
+		aptr += img->pitch;
+		bptr -= img->pitch;
 	}
 }
 
 void img_hflip(struct img_pixmap *img)
 {
 	int i;
-	char *aptr, *bptr, *tmp;
+	char *aptr, *bptr, tmp[4 * sizeof(float)];	/* largest pixel: RGBAF */
 
 	if(img->width <= 1 || img->height <= 0) return;
 
-	tmp = alloca(img->pixelsz);
 	for(i=0; i<img->height; i++) {
-		aptr = (char*)img->pixels + img->width * img->pixelsz * i;
-		bptr = aptr + img->width - 1;
+		aptr = (char*)img->pixels + (size_t)i * img->pitch;
+		bptr = aptr + (img->width - 1) * img->pixelsz;
 
 		while(aptr < bptr) {
 			memcpy(tmp, aptr, img->pixelsz);
 			memcpy(aptr, bptr, img->pixelsz);
 			memcpy(bptr, tmp, img->pixelsz);
-			aptr++;
-			bptr--;
+			aptr += img->pixelsz;
+			bptr -= img->pixelsz;
 		}
 	}
 }
 
 void img_premul_alpha(struct img_pixmap *img)
 {
-	unsigned int i, npix;
+	int i, j;
 
 	if(!img_has_alpha(img)) return;
 
-	npix = img->width * img->height;
-	if(img_is_float(img)) {
-		float *pptr = img->pixels;
-
-		for(i=0; i<npix; i++) {
-			pptr[0] *= pptr[3];
-			pptr[1] *= pptr[3];
-			pptr[2] *= pptr[3];
-			pptr += 4;
-		}
-	} else {
-		unsigned int r, g, b, a;
-		unsigned char *pptr = img->pixels;
-
-		for(i=0; i<npix; i++) {
-			r = pptr[0];
-			g = pptr[1];
-			b = pptr[2];
-			a = pptr[3];
-			pptr[0] = (r * a) >> 8;
-			pptr[1] = (g * a) >> 8;
-			pptr[2] = (b * a) >> 8;
-			pptr += 4;
+	for(i=0; i<img->height; i++) {
+		if(img_is_float(img)) {
+			float *pptr = (float*)((char*)img->pixels + (size_t)i * img->pitch);
+
+			for(j=0; j<img->width; j++) {
+				pptr[0] *= pptr[3];
+				pptr[1] *= pptr[3];
+				pptr[2] *= pptr[3];
+				pptr += 4;
+			}
+		} else {
+			unsigned int r, g, b, a;
+			unsigned char *pptr = (unsigned char*)img->pixels + (size_t)i * img->pitch;
+
+			for(j=0; j<img->width; j++) {
+				r = pptr[0];
+				g = pptr[1];
+				b = pptr[2];
+				a = pptr[3];
+				pptr[0] = (r * a) >> 8;
+				pptr[1] = (g * a) >> 8;
+				pptr[2] = (b * a) >> 8;
+				pptr += 4;
+			}
 		}
 	}
 }
@@ -0,0 +1,67 @@
+/*
+libimago - a multi-format image file input/output library.
+Copyright (C) 2010-2026 John Tsiombikas <nuclear@mutantstargoat.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef IMAGO_CONV_H_
+#define IMAGO_CONV_H_
+
+#include "imago2.h"
+
+/* scalar pixel conversion kernel: converts count pixels from sptr to dptr */
+typedef void (*conv_func)(void *dptr, void *sptr, int count, struct img_colormap *cmap);
+
+/* SIMD pixel conversion kernel: converts as many of the count pixels as it can
+ * handle in whole vectors, and returns how many it converted. The remaining
+ * pixels are left for the scalar kernel, which is the reference: the output of
+ * the SIMD kernels must be bit-identical to it.
+ */
+typedef int (*simd_conv_func)(void *dptr, void *sptr, int count);
+
+/* frees the pixel buffer of a pixmap, or hands it back to its owner, according
+ * to its ownership (see img_wrap_pixels). Defined in imago2.c.
+ */
+void img_release_pixels(struct img_pixmap *img);
+
+/* computes the size in bytes of the pixels of a w x h image, with pitch bytes
+ * per row. Returns -1 if the dimensions are invalid, or the size doesn't fit
+ * in a size_t. Defined in imago2.c.
+ */
+int img_pixels_size(int w, int h, int pixsz, int pitch, size_t *res);
+
+/* converts the pixels of src into the existing pixel buffer of dest, in the
+ * pixel format of dest. Both must have the same dimensions, and dest can't be
+ * IMG_FMT_IDX8.
+ */
+int img_convert_into(struct img_pixmap *dest, struct img_pixmap *src);
+
+/* Returns a pointer to row y of img in pixel format tofmt (which can't be
+ * IMG_FMT_IDX8): the row itself if img is already in that format, otherwise buf,
+ * after converting the row into it. buf must have room for img->width pixels.
+ * Converts serially, for code that goes over the image in bands of its own.
+ */
+unsigned char *img_get_row(unsigned char *buf, enum img_fmt tofmt, struct img_pixmap *img, int y);
+
+/* returns the best SIMD kernel for the CPU we're running on, or null */
+simd_conv_func img_conv_simd(enum img_fmt from, enum img_fmt to);
+/* limits the SIMD kernels to instruction sets up to maxlevel, so that the tests
+ * can compare them to the scalar kernels: 0 turns them off, 1 is SSE2 (or NEON),
+ * 2 SSSE3, 3 AVX2, and -1 (the default) is whatever the CPU supports.
+ * Not to be called during conversions.
+ */
+void img_use_simd(int maxlevel);
+
+#endif	/* IMAGO_CONV_H_ */
@@ -0,0 +1,632 @@
+/*
+libimago - a multi-format image file input/output library.
+Copyright (C) 2010-2026 John Tsiombikas <nuclear@mutantstargoat.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* SIMD versions of the hottest pixel conversion kernels from conv.c.
+ * On x86 every instruction set beyond the compiler's baseline is compiled with
+ * per-function target attributes, and selected at runtime according to what
+ * the CPU supports, so a single build runs everywhere. On aarch64 NEON is
+ * always available, but the NEON kernels haven't been built or tested on real
+ * hardware yet, so they're only used if configured with --enable-neon.
+ * The scalar kernels in conv.c are the reference: these must produce
+ * bit-identical results, and leave any leftover pixels to them.
+ */
+#include <string.h>
+#include <limits.h>
+#include "conv.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMD_X86
+#include <immintrin.h>
+
+#define TARGET_SSE2		__attribute__((target("sse2")))
+#define TARGET_SSSE3	__attribute__((target("ssse3")))
+#define TARGET_AVX2		__attribute__((target("avx2")))
+
+#elif defined(ENABLE_NEON) && defined(__GNUC__) && defined(__aarch64__) && (defined(__ARM_NEON) || defined(__ARM_NEON__))
+#define SIMD_NEON
+#include <arm_neon.h>
+#endif
+
+/* stays empty without SIMD support, to always use the scalar kernels */
+static simd_conv_func kernels[NUM_IMG_FMT][NUM_IMG_FMT];
+
+#if defined(SIMD_X86) || defined(SIMD_NEON)
+/* fills in the kernels of instruction set levels up to maxlevel (see img_use_simd) */
+static void set_kernels(int maxlevel);
+
+/* the kernel table is filled in before main, so that it's never written to
+ * while conversions look it up, from whichever threads they run on
+ */
+__attribute__((constructor)) static void init_kernels(void)
+{
+	set_kernels(INT_MAX);
+}
+#endif
+
+
+simd_conv_func img_conv_simd(enum img_fmt from, enum img_fmt to)
+{
+	return kernels[from][to];
+}
+
+void img_use_simd(int maxlevel)
+{
+	memset(kernels, 0, sizeof kernels);
+#if defined(SIMD_X86) || defined(SIMD_NEON)
+	set_kernels(maxlevel < 0 ? INT_MAX : maxlevel);
+#endif
+}
+
+#ifdef SIMD_X86
+/* ---- SSE2 ---- */
+
+/* RGBA32 <-> BGRA32: swap bytes 0 and 2 of every pixel */
+TARGET_SSE2 static int swap_rb32_sse2(void *dptr, void *sptr, int count)
+{
+	int i;
+	__m128i v, rb, ag;
+	__m128i *src = sptr, *dest = dptr;
+	__m128i rbmask = _mm_set1_epi32(0x00ff00ff);
+
+	for(i=0; i<count / 4; i++) {
+		v = _mm_loadu_si128(src++);
+		rb = _mm_and_si128(v, rbmask);
+		ag = _mm_andnot_si128(rbmask, v);
+		rb = _mm_or_si128(_mm_slli_epi32(rb, 16), _mm_srli_epi32(rb, 16));
+		_mm_storeu_si128(dest++, _mm_or_si128(_mm_and_si128(rb, rbmask), ag));
+	}
+	return count & ~3;
+}
+
+/* byte channels to float channels, 16 at a time. if grey is set, every value
+ * goes through (x + x + x) / 3, like the scalar grey kernels do.
+ */
+TARGET_SSE2 static void btof_sse2(float *dest, unsigned char *src, int nval, int grey)
+{
+	int i, j;
+	__m128i v, v16[2], zero = _mm_setzero_si128();
+	__m128 f, s255 = _mm_set1_ps(255.0f), s3 = _mm_set1_ps(3.0f);
+
+	for(i=0; i<nval / 16; i++) {
+		v = _mm_loadu_si128((__m128i*)src);
+		v16[0] = _mm_unpacklo_epi8(v, zero);
+		v16[1] = _mm_unpackhi_epi8(v, zero);
+
+		for(j=0; j<4; j++) {
+			v = (j & 1) ? _mm_unpackhi_epi16(v16[j >> 1], zero) : _mm_unpacklo_epi16(v16[j >> 1], zero);
+			f = _mm_div_ps(_mm_cvtepi32_ps(v), s255);
+			if(grey) {
+				f = _mm_div_ps(_mm_add_ps(_mm_add_ps(f, f), f), s3);
+			}
+			_mm_storeu_ps(dest, f);
+			dest += 4;
+		}
+		src += 16;
+	}
+}
+
+/* float channels to byte channels, 16 at a time: same as FTOB in conv.c.
+ * max(x, 0) returns 0 for NaN, because maxps returns the second operand.
+ */
+TARGET_SSE2 static void ftob_sse2(unsigned char *dest, float *src, int nval, int grey)
+{
+	int i, j;
+	__m128 f;
+	__m128i v[4];
+	__m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+	__m128 s255 = _mm_set1_ps(255.0f), s3 = _mm_set1_ps(3.0f);
+
+	for(i=0; i<nval / 16; i++) {
+		for(j=0; j<4; j++) {
+			f = _mm_loadu_ps(src);
+			if(grey) {
+				f = _mm_div_ps(_mm_add_ps(_mm_add_ps(f, f), f), s3);
+			}
+			f = _mm_min_ps(_mm_max_ps(f, zero), one);
+			v[j] = _mm_cvttps_epi32(_mm_mul_ps(f, s255));
+			src += 4;
+		}
+		v[0] = _mm_packs_epi32(v[0], v[1]);
+		v[2] = _mm_packs_epi32(v[2], v[3]);
+		_mm_storeu_si128((__m128i*)dest, _mm_packus_epi16(v[0], v[2]));
+		dest += 16;
+	}
+}
+
+/* expand RGB565 to 8bit channels, filling the low bits with bit 0 of each
+ * channel, like unpack565 in conv.c. Produces 8 pixels as two vectors of
+ * 32bit pixels with the red channel in the low byte, or blue if swap is set.
+ */
+TARGET_SSE2 static void unpack565_sse2(__m128i *res, __m128i p, int swap)
+{
+	__m128i r, g, b, t, rg, ba;
+	__m128i ff = _mm_set1_epi16(-256);	/* 0xff00 */
+
+	b = _mm_slli_epi16(_mm_and_si128(p, _mm_set1_epi16(0x1f)), 3);
+	t = _mm_and_si128(_mm_srli_epi16(b, 3), _mm_set1_epi16(1));
+	b = _mm_or_si128(b, _mm_sub_epi16(_mm_slli_epi16(t, 3), t));
+
+	g = _mm_and_si128(_mm_srli_epi16(p, 3), _mm_set1_epi16(0xfc));
+	t = _mm_and_si128(_mm_srli_epi16(g, 2), _mm_set1_epi16(1));
+	g = _mm_or_si128(g, _mm_add_epi16(_mm_slli_epi16(t, 1), t));
+
+	r = _mm_and_si128(_mm_srli_epi16(p, 8), _mm_set1_epi16(0xf8));
+	t = _mm_and_si128(_mm_srli_epi16(r, 3), _mm_set1_epi16(1));
+	r = _mm_or_si128(r, _mm_sub_epi16(_mm_slli_epi16(t, 3), t));
+
+	if(swap) {
+		t = r;
+		r = b;
+		b = t;
+	}
+	rg = _mm_or_si128(r, _mm_slli_epi16(g, 8));
+	ba = _mm_or_si128(b, ff);
+	res[0] = _mm_unpacklo_epi16(rg, ba);
+	res[1] = _mm_unpackhi_epi16(rg, ba);
+}
+
+TARGET_SSE2 static int rgb565_to_32_sse2(void *dptr, void *sptr, int count, int swap)
+{
+	int i;
+	__m128i res[2];
+	__m128i *src = sptr, *dest = dptr;
+
+	for(i=0; i<count / 8; i++) {
+		unpack565_sse2(res, _mm_loadu_si128(src++), swap);
+		_mm_storeu_si128(dest++, res[0]);
+		_mm_storeu_si128(dest++, res[1]);
+	}
+	return count & ~7;
+}
+
+TARGET_SSE2 static int grey8_greyf_sse2(void *dptr, void *sptr, int count)
+{
+	btof_sse2(dptr, sptr, count & ~15, 1);
+	return count & ~15;
+}
+
+TARGET_SSE2 static int rgb24_rgbf_sse2(void *dptr, void *sptr, int count)
+{
+	btof_sse2(dptr, sptr, (count & ~15) * 3, 0);
+	return count & ~15;
+}
+
+TARGET_SSE2 static int rgba32_rgbaf_sse2(void *dptr, void *sptr, int count)
+{
+	btof_sse2(dptr, sptr, (count & ~3) * 4, 0);
+	return count & ~3;
+}
+
+TARGET_SSE2 static int greyf_grey8_sse2(void *dptr, void *sptr, int count)
+{
+	ftob_sse2(dptr, sptr, count & ~15, 1);
+	return count & ~15;
+}
+
+TARGET_SSE2 static int rgbf_rgb24_sse2(void *dptr, void *sptr, int count)
+{
+	ftob_sse2(dptr, sptr, (count & ~15) * 3, 0);
+	return count & ~15;
+}
+
+TARGET_SSE2 static int rgbaf_rgba32_sse2(void *dptr, void *sptr, int count)
+{
+	ftob_sse2(dptr, sptr, (count & ~3) * 4, 0);
+	return count & ~3;
+}
+
+TARGET_SSE2 static int rgb565_rgba32_sse2(void *dptr, void *sptr, int count)
+{
+	return rgb565_to_32_sse2(dptr, sptr, count, 0);
+}
+
+TARGET_SSE2 static int rgb565_bgra32_sse2(void *dptr, void *sptr, int count)
+{
+	return rgb565_to_32_sse2(dptr, sptr, count, 1);
+}
+
+/* ---- SSSE3 ---- */
+
+/* 24bit to 32bit pixels, 16 at a time, shuffling bytes with the given mask
+ * and setting alpha to 255.
+ */
+TARGET_SSSE3 static int rgb24_to_32_ssse3(void *dptr, void *sptr, int count, __m128i mask)
+{
+	int i;
+	__m128i a, b, c;
+	__m128i *src = sptr, *dest = dptr;
+	__m128i alpha = _mm_set1_epi32(0xff000000);
+
+	for(i=0; i<count / 16; i++) {
+		a = _mm_loadu_si128(src++);
+		b = _mm_loadu_si128(src++);
+		c = _mm_loadu_si128(src++);
+
+		_mm_storeu_si128(dest++, _mm_or_si128(_mm_shuffle_epi8(a, mask), alpha));
+		_mm_storeu_si128(dest++, _mm_or_si128(_mm_shuffle_epi8(_mm_alignr_epi8(b, a, 12), mask), alpha));
+		_mm_storeu_si128(dest++, _mm_or_si128(_mm_shuffle_epi8(_mm_alignr_epi8(c, b, 8), mask), alpha));
+		_mm_storeu_si128(dest++, _mm_or_si128(_mm_shuffle_epi8(_mm_srli_si128(c, 4), mask), alpha));
+	}
+	return count & ~15;
+}
+
+/* 32bit to 24bit pixels, 16 at a time. The mask packs the 12 bytes we keep
+ * from each vector at the bottom.
+ */
+TARGET_SSSE3 static int rgb32_to_24_ssse3(void *dptr, void *sptr, int count, __m128i mask)
+{
+	int i;
+	__m128i a, b, c, d;
+	__m128i *src = sptr, *dest = dptr;
+
+	for(i=0; i<count / 16; i++) {
+		a = _mm_shuffle_epi8(_mm_loadu_si128(src++), mask);
+		b = _mm_shuffle_epi8(_mm_loadu_si128(src++), mask);
+		c = _mm_shuffle_epi8(_mm_loadu_si128(src++), mask);
+		d = _mm_shuffle_epi8(_mm_loadu_si128(src++), mask);
+
+		_mm_storeu_si128(dest++, _mm_or_si128(a, _mm_slli_si128(b, 12)));
+		_mm_storeu_si128(dest++, _mm_or_si128(_mm_srli_si128(b, 4), _mm_slli_si128(c, 8)));
+		_mm_storeu_si128(dest++, _mm_or_si128(_mm_srli_si128(c, 8), _mm_slli_si128(d, 4)));
+	}
+	return count & ~15;
+}
+
+TARGET_SSSE3 static int rgb24_rgba32_ssse3(void *dptr, void *sptr, int count)
+{
+	__m128i mask = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+	return rgb24_to_32_ssse3(dptr, sptr, count, mask);
+}
+
+TARGET_SSSE3 static int rgb24_bgra32_ssse3(void *dptr, void *sptr, int count)
+{
+	__m128i mask = _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1);
+	return rgb24_to_32_ssse3(dptr, sptr, count, mask);
+}
+
+TARGET_SSSE3 static int rgba32_rgb24_ssse3(void *dptr, void *sptr, int count)
+{
+	__m128i mask = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+	return rgb32_to_24_ssse3(dptr, sptr, count, mask);
+}
+
+TARGET_SSSE3 static int bgra32_rgb24_ssse3(void *dptr, void *sptr, int count)
+{
+	__m128i mask = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+	return rgb32_to_24_ssse3(dptr, sptr, count, mask);
+}
+
+/* ---- AVX2 ---- */
+
+TARGET_AVX2 static int swap_rb32_avx2(void *dptr, void *sptr, int count)
+{
+	int i;
+	__m256i *src = sptr, *dest = dptr;
+	__m256i mask = _mm256_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+			2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+
+	for(i=0; i<count / 8; i++) {
+		_mm256_storeu_si256(dest++, _mm256_shuffle_epi8(_mm256_loadu_si256(src++), mask));
+	}
+	return count & ~7;
+}
+
+TARGET_AVX2 static void btof_avx2(float *dest, unsigned char *src, int nval, int grey)
+{
+	int i;
+	__m256 f, s255 = _mm256_set1_ps(255.0f), s3 = _mm256_set1_ps(3.0f);
+
+	for(i=0; i<nval / 8; i++) {
+		__m128i v = _mm_loadl_epi64((__m128i*)src);
+		f = _mm256_div_ps(_mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(v)), s255);
+		if(grey) {
+			f = _mm256_div_ps(_mm256_add_ps(_mm256_add_ps(f, f), f), s3);
+		}
+		_mm256_storeu_ps(dest, f);
+		src += 8;
+		dest += 8;
+	}
+}
+
+TARGET_AVX2 static void ftob_avx2(unsigned char *dest, float *src, int nval, int grey)
+{
+	int i, j;
+	__m256 f;
+	__m256i v[4];
+	__m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.0f);
+	__m256 s255 = _mm256_set1_ps(255.0f), s3 = _mm256_set1_ps(3.0f);
+	/* undo the per-lane interleaving of the pack instructions */
+	__m256i perm = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+
+	for(i=0; i<nval / 32; i++) {
+		for(j=0; j<4; j++) {
+			f = _mm256_loadu_ps(src);
+			if(grey) {
+				f = _mm256_div_ps(_mm256_add_ps(_mm256_add_ps(f, f), f), s3);
+			}
+			f = _mm256_min_ps(_mm256_max_ps(f, zero), one);
+			v[j] = _mm256_cvttps_epi32(_mm256_mul_ps(f, s255));
+			src += 8;
+		}
+		v[0] = _mm256_packs_epi32(v[0], v[1]);
+		v[2] = _mm256_packs_epi32(v[2], v[3]);
+		v[0] = _mm256_packus_epi16(v[0], v[2]);
+		_mm256_storeu_si256((__m256i*)dest, _mm256_permutevar8x32_epi32(v[0], perm));
+		dest += 32;
+	}
+}
+
+TARGET_AVX2 static int grey8_greyf_avx2(void *dptr, void *sptr, int count)
+{
+	btof_avx2(dptr, sptr, count & ~7, 1);
+	return count & ~7;
+}
+
+TARGET_AVX2 static int rgb24_rgbf_avx2(void *dptr, void *sptr, int count)
+{
+	btof_avx2(dptr, sptr, (count & ~7) * 3, 0);
+	return count & ~7;
+}
+
+TARGET_AVX2 static int rgba32_rgbaf_avx2(void *dptr, void *sptr, int count)
+{
+	btof_avx2(dptr, sptr, (count & ~1) * 4, 0);
+	return count & ~1;
+}
+
+TARGET_AVX2 static int greyf_grey8_avx2(void *dptr, void *sptr, int count)
+{
+	ftob_avx2(dptr, sptr, count & ~31, 1);
+	return count & ~31;
+}
+
+TARGET_AVX2 static int rgbf_rgb24_avx2(void *dptr, void *sptr, int count)
+{
+	ftob_avx2(dptr, sptr, (count & ~31) * 3, 0);
+	return count & ~31;
+}
+
+TARGET_AVX2 static int rgbaf_rgba32_avx2(void *dptr, void *sptr, int count)
+{
+	ftob_avx2(dptr, sptr, (count & ~7) * 4, 0);
+	return count & ~7;
+}
+
+static void set_kernels(int maxlevel)
+{
+	__builtin_cpu_init();
+
+	if(maxlevel >= 1 && __builtin_cpu_supports("sse2")) {
+		kernels[IMG_FMT_RGBA32][IMG_FMT_BGRA32] = swap_rb32_sse2;
+		kernels[IMG_FMT_BGRA32][IMG_FMT_RGBA32] = swap_rb32_sse2;
+		kernels[IMG_FMT_GREY8][IMG_FMT_GREYF] = grey8_greyf_sse2;
+		kernels[IMG_FMT_RGB24][IMG_FMT_RGBF] = rgb24_rgbf_sse2;
+		kernels[IMG_FMT_RGBA32][IMG_FMT_RGBAF] = rgba32_rgbaf_sse2;
+		kernels[IMG_FMT_GREYF][IMG_FMT_GREY8] = greyf_grey8_sse2;
+		kernels[IMG_FMT_RGBF][IMG_FMT_RGB24] = rgbf_rgb24_sse2;
+		kernels[IMG_FMT_RGBAF][IMG_FMT_RGBA32] = rgbaf_rgba32_sse2;
+		kernels[IMG_FMT_RGB565][IMG_FMT_RGBA32] = rgb565_rgba32_sse2;
+		kernels[IMG_FMT_RGB565][IMG_FMT_BGRA32] = rgb565_bgra32_sse2;
+	}
+	if(maxlevel >= 2 && __builtin_cpu_supports("ssse3")) {
+		kernels[IMG_FMT_RGB24][IMG_FMT_RGBA32] = rgb24_rgba32_ssse3;
+		kernels[IMG_FMT_RGB24][IMG_FMT_BGRA32] = rgb24_bgra32_ssse3;
+		kernels[IMG_FMT_RGBA32][IMG_FMT_RGB24] = rgba32_rgb24_ssse3;
+		kernels[IMG_FMT_BGRA32][IMG_FMT_RGB24] = bgra32_rgb24_ssse3;
+	}
+	if(maxlevel >= 3 && __builtin_cpu_supports("avx2")) {
+		kernels[IMG_FMT_RGBA32][IMG_FMT_BGRA32] = swap_rb32_avx2;
+		kernels[IMG_FMT_BGRA32][IMG_FMT_RGBA32] = swap_rb32_avx2;
+		kernels[IMG_FMT_GREY8][IMG_FMT_GREYF] = grey8_greyf_avx2;
+		kernels[IMG_FMT_RGB24][IMG_FMT_RGBF] = rgb24_rgbf_avx2;
+		kernels[IMG_FMT_RGBA32][IMG_FMT_RGBAF] = rgba32_rgbaf_avx2;
+		kernels[IMG_FMT_GREYF][IMG_FMT_GREY8] = greyf_grey8_avx2;
+		kernels[IMG_FMT_RGBF][IMG_FMT_RGB24] = rgbf_rgb24_avx2;
+		kernels[IMG_FMT_RGBAF][IMG_FMT_RGBA32] = rgbaf_rgba32_avx2;
+	}
+}
+
+#elif defined(SIMD_NEON)
+/* ---- NEON ---- */
+
+static int rgb24_to_32_neon(void *dptr, void *sptr, int count, int swap)
+{
+	int i;
+	uint8x16x3_t s;
+	uint8x16x4_t d;
+	unsigned char *src = sptr, *dest = dptr;
+
+	d.val[3] = vdupq_n_u8(0xff);
+	for(i=0; i<count / 16; i++) {
+		s = vld3q_u8(src);
+		d.val[0] = s.val[swap ? 2 : 0];
+		d.val[1] = s.val[1];
+		d.val[2] = s.val[swap ? 0 : 2];
+		vst4q_u8(dest, d);
+		src += 48;
+		dest += 64;
+	}
+	return count & ~15;
+}
+
+static int rgb32_to_24_neon(void *dptr, void *sptr, int count, int swap)
+{
+	int i;
+	uint8x16x4_t s;
+	uint8x16x3_t d;
+	unsigned char *src = sptr, *dest = dptr;
+
+	for(i=0; i<count / 16; i++) {
+		s = vld4q_u8(src);
+		d.val[0] = s.val[swap ? 2 : 0];
+		d.val[1] = s.val[1];
+		d.val[2] = s.val[swap ? 0 : 2];
+		vst3q_u8(dest, d);
+		src += 64;
+		dest += 48;
+	}
+	return count & ~15;
+}
+
+static int swap_rb32_neon(void *dptr, void *sptr, int count)
+{
+	int i;
+	uint8x16x4_t v;
+	uint8x16_t t;
+	unsigned char *src = sptr, *dest = dptr;
+
+	for(i=0; i<count / 16; i++) {
+		v = vld4q_u8(src);
+		t = v.val[0];
+		v.val[0] = v.val[2];
+		v.val[2] = t;
+		vst4q_u8(dest, v);
+		src += 64;
+		dest += 64;
+	}
+	return count & ~15;
+}
+
+static void btof_neon(float *dest, unsigned char *src, int nval, int grey)
+{
+	int i, j;
+	uint8x16_t v;
+	uint16x8_t v16[2];
+	uint32x4_t v32;
+	float32x4_t f, s255 = vdupq_n_f32(255.0f), s3 = vdupq_n_f32(3.0f);
+
+	for(i=0; i<nval / 16; i++) {
+		v = vld1q_u8(src);
+		v16[0] = vmovl_u8(vget_low_u8(v));
+		v16[1] = vmovl_u8(vget_high_u8(v));
+
+		for(j=0; j<4; j++) {
+			v32 = (j & 1) ? vmovl_u16(vget_high_u16(v16[j >> 1])) : vmovl_u16(vget_low_u16(v16[j >> 1]));
+			f = vdivq_f32(vcvtq_f32_u32(v32), s255);
+			if(grey) {
+				f = vdivq_f32(vaddq_f32(vaddq_f32(f, f), f), s3);
+			}
+			vst1q_f32(dest, f);
+			dest += 4;
+		}
+		src += 16;
+	}
+}
+
+/* vmaxnm returns the number if the other operand is NaN, like FTOB in conv.c */
+static void ftob_neon(unsigned char *dest, float *src, int nval, int grey)
+{
+	int i, j;
+	float32x4_t f;
+	uint32x4_t v[4];
+	uint16x8_t lo, hi;
+	float32x4_t zero = vdupq_n_f32(0.0f), one = vdupq_n_f32(1.0f);
+	float32x4_t s255 = vdupq_n_f32(255.0f), s3 = vdupq_n_f32(3.0f);
+
+	for(i=0; i<nval / 16; i++) {
+		for(j=0; j<4; j++) {
+			f = vld1q_f32(src);
+			if(grey) {
+				f = vdivq_f32(vaddq_f32(vaddq_f32(f, f), f), s3);
+			}
+			f = vminq_f32(vmaxnmq_f32(f, zero), one);
+			v[j] = vcvtq_u32_f32(vmulq_f32(f, s255));
+			src += 4;
+		}
+		lo = vcombine_u16(vmovn_u32(v[0]), vmovn_u32(v[1]));
+		hi = vcombine_u16(vmovn_u32(v[2]), vmovn_u32(v[3]));
+		vst1q_u8(dest, vcombine_u8(vmovn_u16(lo), vmovn_u16(hi)));
+		dest += 16;
+	}
+}
+
+static int rgb24_rgba32_neon(void *dptr, void *sptr, int count)
+{
+	return rgb24_to_32_neon(dptr, sptr, count, 0);
+}
+
+static int rgb24_bgra32_neon(void *dptr, void *sptr, int count)
+{
+	return rgb24_to_32_neon(dptr, sptr, count, 1);
+}
+
+static int rgba32_rgb24_neon(void *dptr, void *sptr, int count)
+{
+	return rgb32_to_24_neon(dptr, sptr, count, 0);
+}
+
+static int bgra32_rgb24_neon(void *dptr, void *sptr, int count)
+{
+	return rgb32_to_24_neon(dptr, sptr, count, 1);
+}
+
+static int grey8_greyf_neon(void *dptr, void *sptr, int count)
+{
+	btof_neon(dptr, sptr, count & ~15, 1);
+	return count & ~15;
+}
+
+static int rgb24_rgbf_neon(void *dptr, void *sptr, int count)
+{
+	btof_neon(dptr, sptr, (count & ~15) * 3, 0);
+	return count & ~15;
+}
+
+static int rgba32_rgbaf_neon(void *dptr, void *sptr, int count)
+{
+	btof_neon(dptr, sptr, (count & ~3) * 4, 0);
+	return count & ~3;
+}
+
+static int greyf_grey8_neon(void *dptr, void *sptr, int count)
+{
+	ftob_neon(dptr, sptr, count & ~15, 1);
+	return count & ~15;
+}
+
+static int rgbf_rgb24_neon(void *dptr, void *sptr, int count)
+{
+	ftob_neon(dptr, sptr, (count & ~15) * 3, 0);
+	return count & ~15;
+}
+
+static int rgbaf_rgba32_neon(void *dptr, void *sptr, int count)
+{
+	ftob_neon(dptr, sptr, (count & ~3) * 4, 0);
+	return count & ~3;
+}
+
+static void set_kernels(int maxlevel)
+{
+	if(maxlevel < 1) return;
+
+	kernels[IMG_FMT_RGBA32][IMG_FMT_BGRA32] = swap_rb32_neon;
+	kernels[IMG_FMT_BGRA32][IMG_FMT_RGBA32] = swap_rb32_neon;
+	kernels[IMG_FMT_RGB24][IMG_FMT_RGBA32] = rgb24_rgba32_neon;
+	kernels[IMG_FMT_RGB24][IMG_FMT_BGRA32] = rgb24_bgra32_neon;
+	kernels[IMG_FMT_RGBA32][IMG_FMT_RGB24] = rgba32_rgb24_neon;
+	kernels[IMG_FMT_BGRA32][IMG_FMT_RGB24] = bgra32_rgb24_neon;
+	kernels[IMG_FMT_GREY8][IMG_FMT_GREYF] = grey8_greyf_neon;
+	kernels[IMG_FMT_RGB24][IMG_FMT_RGBF] = rgb24_rgbf_neon;
+	kernels[IMG_FMT_RGBA32][IMG_FMT_RGBAF] = rgba32_rgbaf_neon;
+	kernels[IMG_FMT_GREYF][IMG_FMT_GREY8] = greyf_grey8_neon;
+	kernels[IMG_FMT_RGBF][IMG_FMT_RGB24] = rgbf_rgb24_neon;
+	kernels[IMG_FMT_RGBAF][IMG_FMT_RGBA32] = rgbaf_rgba32_neon;
+}
+
+#endif	/* SIMD_NEON */
@@ -32,6 +32,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <jpeglib.h>
 #include "imago2.h"
 #include "ftmodule.h"
+#include "alloc.h"
 
 #define INPUT_BUF_SIZE	512
 #define OUTPUT_BUF_SIZE	512
@@ -41,6 +42,7 @@ struct src_mgr {
 	struct jpeg_source_mgr pub;
 
 	struct img_io *io;
+	struct img_memsrc *mem;	/* non-null while decoding straight out of memory */
 	unsigned char buffer[INPUT_BUF_SIZE];
 	int start_of_file;
 };
@@ -56,10 +58,12 @@ struct dst_mgr {
 static int check(struct img_io *io);
 static int read(struct img_pixmap *img, struct img_io *io);
 static int write(struct img_pixmap *img, struct img_io *io);
+static size_t write_size(struct img_pixmap *img);
 
 /* read source functions */
 static void init_source(j_decompress_ptr jd);
 static boolean fill_input_buffer(j_decompress_ptr jd);
+static boolean fill_mem_input_buffer(j_decompress_ptr jd);
 static void skip_input_data(j_decompress_ptr jd, long num_bytes);
 static void term_source(j_decompress_ptr jd);
 
@@ -70,7 +74,7 @@ static void term_destination(j_compress_ptr jc);
 
 int img_register_jpeg(void)
 {
-	static struct ftype_module mod = {".jpg:.jpeg", check, read, write};
+	static struct ftype_module mod = {".jpg:.jpeg", check, read, write, write_size};
 	return img_register_module(&mod);
 }
 
@@ -115,7 +119,7 @@ static int read(struct img_pixmap *img, struct img_io *io)
 	struct jpeg_decompress_struct cinfo;
 	struct error_mgr jerr;
 	struct src_mgr src;
-	unsigned char **scanlines;
+	unsigned char **volatile scanlines = 0;	/* set after setjmp */
 
 	io->seek(0, SEEK_CUR, io->uptr);
 
@@ -125,7 +129,7 @@ static int read(struct img_pixmap *img, struct img_io *io)
 	if(setjmp(jerr.jmpbuf)) {
 		/* libjpeg raised an error, cleanup and return */
 		jpeg_destroy_decompress(&cinfo);
-		free(scanlines);
+		img_mem_free(scanlines);
 		return -1;
 	}
 
@@ -139,23 +143,31 @@ static int read(struct img_pixmap *img, struct img_io *io)
 	src.pub.next_input_byte = 0;
 	src.pub.bytes_in_buffer = 0;
 	src.io = io;
+	/* reading from memory, hand the whole buffer to libjpeg at once */
+	if((src.mem = img_io_memsrc(io))) {
+		src.pub.fill_input_buffer = fill_mem_input_buffer;
+		if(src.mem->pos < src.mem->size) {
+			src.pub.next_input_byte = src.mem->data + src.mem->pos;
+			src.pub.bytes_in_buffer = src.mem->size - src.mem->pos;
+		}
+	}
 	cinfo.src = (struct jpeg_source_mgr*)&src;
 
 	jpeg_read_header(&cinfo, 1);
 	cinfo.out_color_space = JCS_RGB;
 
-	if(img_set_pixels(img, cinfo.image_width, cinfo.image_height, IMG_FMT_RGB24, 0) == -1) {
+	if(img_prepare_pixels(img, cinfo.image_width, cinfo.image_height, IMG_FMT_RGB24) == -1) {
 		jpeg_destroy_decompress(&cinfo);
 		return -1;
 	}
 
-	if(!(scanlines = malloc(img->height * sizeof *scanlines))) {
+	if(!(scanlines = img_mem_alloc(img->height * sizeof *scanlines))) {
 		jpeg_destroy_decompress(&cinfo);
 		return -1;
 	}
 	scanlines[0] = img->pixels;
 	for(i=1; i<img->height; i++) {
-		scanlines[i] = scanlines[i - 1] + img->width * img->pixelsz;
+		scanlines[i] = scanlines[i - 1] + img->pitch;
 	}
 
 	jpeg_start_decompress(&cinfo);
@@ -166,7 +178,7 @@ static int read(struct img_pixmap *img, struct img_io *io)
 	jpeg_finish_decompress(&cinfo);
 	jpeg_destroy_decompress(&cinfo);
 
-	free(scanlines);
+	img_mem_free(scanlines);
 	return 0;
 }
 
@@ -182,7 +194,7 @@ static int write(struct img_pixmap *img, struct img_io *io)
 	img_init(&tmpimg);
 
 	if(img->fmt != IMG_FMT_RGB24) {
-		if(img_copy(&tmpimg, img) == -1) {
+		if(img_view(&tmpimg, img, 0, 0, img->width, img->height) == -1) {
 			return -1;
 		}
 		if(img_convert(&tmpimg, IMG_FMT_RGB24) == -1) {
@@ -192,13 +204,13 @@ static int write(struct img_pixmap *img, struct img_io *io)
 		img = &tmpimg;
 	}
 
-	if(!(scanlines = malloc(img->height * sizeof *scanlines))) {
+	if(!(scanlines = img_mem_alloc(img->height * sizeof *scanlines))) {
 		img_destroy(&tmpimg);
 		return -1;
 	}
 	scanlines[0] = img->pixels;
 	for(i=1; i<img->height; i++) {
-		scanlines[i] = scanlines[i - 1] + img->width * img->pixelsz;
+		scanlines[i] = scanlines[i - 1] + img->pitch;
 	}
 
 	cinfo.err = jpeg_std_error(&jerr.root);
@@ -207,7 +219,7 @@ static int write(struct img_pixmap *img, struct img_io *io)
 	if(setjmp(jerr.jmpbuf)) {
 		/* libjpeg raised an error, cleanup and return */
 		jpeg_destroy_compress(&cinfo);
-		free(scanlines);
+		img_mem_free(scanlines);
 		img_destroy(&tmpimg);
 		return -1;
 	}
@@ -236,11 +248,17 @@ static int write(struct img_pixmap *img, struct img_io *io)
 	jpeg_finish_compress(&cinfo);
 	jpeg_destroy_compress(&cinfo);
 
-	free(scanlines);
+	img_mem_free(scanlines);
 	img_destroy(&tmpimg);
 	return 0;
 }
 
+/* at quality 95, detailed photos take up to about 6 bits per pixel, plus the tables */
+static size_t write_size(struct img_pixmap *img)
+{
+	return (size_t)img->width * img->height / 4 * 3 + 1024;
+}
+
 /* -- read source functions --
  * the following functions are adapted from jdatasrc.c in jpeglib
  */
@@ -273,6 +291,23 @@ static boolean fill_input_buffer(j_decompress_ptr jd)
 	return 1;
 }
 
+/* the whole memory buffer is handed over up front, so running out means the
+ * data is truncated: terminate it with a fake EOI marker, as above
+ */
+static boolean fill_mem_input_buffer(j_decompress_ptr jd)
+{
+	static const JOCTET eoi[] = {0xff, JPEG_EOI};
+	struct src_mgr *src = (struct src_mgr*)jd->src;
+
+	if(src->mem) {
+		src->mem->pos = src->mem->size;
+		src->mem = 0;
+	}
+	src->pub.next_input_byte = eoi;
+	src->pub.bytes_in_buffer = 2;
+	return 1;
+}
+
 static void skip_input_data(j_decompress_ptr jd, long num_bytes)
 {
 	struct src_mgr *src = (struct src_mgr*)jd->src;
@@ -280,7 +315,7 @@ static void skip_input_data(j_decompress_ptr jd, long num_bytes)
 	if(num_bytes > 0) {
 		while(num_bytes > (long)src->pub.bytes_in_buffer) {
 			num_bytes -= (long)src->pub.bytes_in_buffer;
-			fill_input_buffer(jd);
+			src->pub.fill_input_buffer(jd);
 		}
 		src->pub.next_input_byte += (size_t)num_bytes;
 		src->pub.bytes_in_buffer -= (size_t)num_bytes;
@@ -289,7 +324,12 @@ static void skip_input_data(j_decompress_ptr jd, long num_bytes)
 
 static void term_source(j_decompress_ptr jd)
 {
-	/* nothing to see here, move along */
+	struct src_mgr *src = (struct src_mgr*)jd->src;
+
+	/* leave the memory source right after the end of the image */
+	if(src->mem) {
+		src->mem->pos = src->mem->size - src->pub.bytes_in_buffer;
+	}
 }
 
 
@@ -21,15 +21,9 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
-#if defined(__WATCOMC__) || defined(WIN32) || defined(MSDOS)
-#include <malloc.h>
-#else
-#ifndef __FreeBSD__
-#include <alloca.h>
-#endif
-#endif
 #include "imago2.h"
 #include "ftmodule.h"
+#include "alloc.h"
 #include "byteord.h"
 
 #ifdef __GNUC__
@@ -197,8 +191,7 @@ static int read_ilbm_pbm(struct img_io *io, uint32_t type, uint32_t size, struct
 	/*struct colrange *crnode;*/
 	struct img_colormap cmap;
 	long start = io->seek(0, SEEK_CUR, io->uptr);
-
-	memset(img, 0, sizeof *img);
+	int have_pixels = 0;
 
 	while(read_header(io, &hdr) != -1 && io->seek(0, SEEK_CUR, io->uptr) - start < (int)size) {
 		switch(hdr.id) {
@@ -207,16 +200,15 @@ static int read_ilbm_pbm(struct img_io *io, uint32_t type, uint32_t size, struct
 			if(read_bmhd(io, &bmhd) == -1) {
 				return -1;
 			}
-			img->width = bmhd.width;
-			img->height = bmhd.height;
 			if(bmhd.nplanes > 8) {
 				/* TODO */
 				fprintf(stderr, "libimago: %d planes found, only paletized LBM files supported\n", bmhd.nplanes);
 				return -1;
 			}
-			if(img_set_pixels(img, img->width, img->height, IMG_FMT_IDX8, 0)) {
+			if(img_prepare_pixels(img, bmhd.width, bmhd.height, IMG_FMT_IDX8) == -1) {
 				return -1;
 			}
+			have_pixels = 1;
 			break;
 
 		case IFF_CMAP:
@@ -228,6 +220,7 @@ static int read_ilbm_pbm(struct img_io *io, uint32_t type, uint32_t size, struct
 			if(io->read(cmap.color, hdr.size, io->uptr) < hdr.size) {
 				return -1;
 			}
+			memset(cmap.alpha, 0xff, sizeof cmap.alpha);
 			break;
 
 		case IFF_CRNG:
@@ -253,7 +246,7 @@ static int read_ilbm_pbm(struct img_io *io, uint32_t type, uint32_t size, struct
 			break;
 
 		case IFF_BODY:
-			if(!img->pixels) {
+			if(!have_pixels) {
 				fprintf(stderr, "libimago: malformed LBM image: encountered BODY chunk before BMHD\n");
 				return -1;
 			}
@@ -320,15 +313,19 @@ static int read_crng(struct img_io *io, struct crng *crng)
  */
 static int read_body_ilbm(struct img_io *io, struct bitmap_header *bmhd, struct img_pixmap *img)
 {
-	int i, j, k, bitidx;
+	int i, j, k, bitidx, res = -1;
 	int rowsz = (img->width + 7) / 8;
 	unsigned char *src, *dest = img->pixels;
-	unsigned char *rowbuf = alloca(rowsz);
+	unsigned char *rowbuf;
 
 	assert(bmhd->width == img->width);
 	assert(bmhd->height == img->height);
 	assert(img->pixels);
 
+	if(!(rowbuf = img_mem_alloc(rowsz))) {
+		return -1;
+	}
+
 	for(i=0; i<img->height; i++) {
 
 		memset(dest, 0, img->width);	/* clear the whole scanline to OR bits into place */
@@ -337,11 +334,11 @@ static int read_body_ilbm(struct img_io *io, struct bitmap_header *bmhd, struct
 			/* read a row corresponding to bitplane j */
 			if(bmhd->compression) {
 				if(read_compressed_scanline(io, rowbuf, rowsz) == -1) {
-					return -1;
+					goto end;
 				}
 			} else {
 				if(io->read(rowbuf, rowsz, io->uptr) < rowsz) {
-					return -1;
+					goto end;
 				}
 			}
 
@@ -364,15 +361,17 @@ static int read_body_ilbm(struct img_io *io, struct bitmap_header *bmhd, struct
 			io->seek(rowsz, SEEK_CUR, io->uptr);
 		}
 
-		dest += img->width;
+		dest += img->pitch;
 	}
-	return 0;
+	res = 0;
+end:
+	img_mem_free(rowbuf);
+	return res;
 }
 
 static int read_body_pbm(struct img_io *io, struct bitmap_header *bmhd, struct img_pixmap *img)
 {
 	int i;
-	int npixels = img->width * img->height;
 	unsigned char *dptr = img->pixels;
 
 	assert(bmhd->width == img->width);
@@ -384,13 +383,16 @@ static int read_body_pbm(struct img_io *io, struct bitmap_header *bmhd, struct i
 			if(read_compressed_scanline(io, dptr, img->width) == -1) {
 				return -1;
 			}
-			dptr += img->width;
+			dptr += img->pitch;
 		}
 
 	} else {
 		/* uncompressed */
-		if(io->read(img->pixels, npixels, io->uptr) < npixels) {
-			return -1;
+		for(i=0; i<img->height; i++) {
+			if(io->read(dptr, img->width, io->uptr) < img->width) {
+				return -1;
+			}
+			dptr += img->pitch;
 		}
 	}
 
@@ -24,10 +24,26 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <png.h>
 #include "imago2.h"
 #include "ftmodule.h"
+#include "alloc.h"
+
+#ifdef PNG_USER_MEM_SUPPORTED
+/* have libpng allocate everything through the libimago allocator too */
+static png_voidp mem_alloc(png_struct *png, png_alloc_size_t sz);
+static void mem_free(png_struct *png, png_voidp ptr);
+
+#define create_read_struct()	\
+	png_create_read_struct_2(PNG_LIBPNG_VER_STRING, 0, 0, 0, 0, mem_alloc, mem_free)
+#define create_write_struct()	\
+	png_create_write_struct_2(PNG_LIBPNG_VER_STRING, 0, 0, 0, 0, mem_alloc, mem_free)
+#else
+#define create_read_struct()	png_create_read_struct(PNG_LIBPNG_VER_STRING, 0, 0, 0)
+#define create_write_struct()	png_create_write_struct(PNG_LIBPNG_VER_STRING, 0, 0, 0)
+#endif
 
 static int check_file(struct img_io *io);
 static int read_file(struct img_pixmap *img, struct img_io *io);
 static int write_file(struct img_pixmap *img, struct img_io *io);
+static size_t write_size(struct img_pixmap *img);
 
 static void read_func(png_struct *png, unsigned char *data, size_t len);
 static void write_func(png_struct *png, unsigned char *data, size_t len);
@@ -39,7 +55,7 @@ static int fmt_to_png_type(enum img_fmt fmt);
 
 int img_register_png(void)
 {
-	static struct ftype_module mod = {".png", check_file, read_file, write_file};
+	static struct ftype_module mod = {".png", check_file, read_file, write_file, write_size};
 	return img_register_module(&mod);
 }
 
@@ -62,15 +78,16 @@ static int check_file(struct img_io *io)
 static int read_file(struct img_pixmap *img, struct img_io *io)
 {
 	unsigned int i, j, num_elem;
-	unsigned char **lineptr;
+	unsigned char **volatile lineptr = 0;
 	png_struct *png;
 	png_info *info;
-	int channel_bits, color_type, ilace_type, compression, filtering, fmt;
+	int channel_bits, color_type, ilace_type, compression, filtering, fmt, num_trans;
 	png_uint_32 xsz, ysz;
 	png_color *palette;
+	png_byte *trans;
 	struct img_colormap *cmap;
 
-	if(!(png = png_create_read_struct(PNG_LIBPNG_VER_STRING, 0, 0, 0))) {
+	if(!(png = create_read_struct())) {
 		return -1;
 	}
 
@@ -81,12 +98,13 @@ static int read_file(struct img_pixmap *img, struct img_io *io)
 
 	if(setjmp(png_jmpbuf(png))) {
 		png_destroy_read_struct(&png, &info, 0);
+		img_mem_free(lineptr);
 		return -1;
 	}
 
 	png_set_read_fn(png, io, read_func);
 	png_set_sig_bytes(png, 0);
-	png_read_png(png, info, 0, 0);
+	png_read_info(png, info);
 
 	png_get_IHDR(png, info, &xsz, &ysz, &channel_bits, &color_type, &ilace_type,
 			&compression, &filtering);
@@ -95,7 +113,13 @@ static int read_file(struct img_pixmap *img, struct img_io *io)
 		return -1;
 	}
 
-	if(img_set_pixels(img, xsz, ysz, fmt, 0) == -1) {
+	if(channel_bits < 8) {
+		png_set_packing(png);	/* one byte per pixel */
+	}
+	png_set_interlace_handling(png);
+	png_read_update_info(png, info);
+
+	if(img_prepare_pixels(img, xsz, ysz, fmt) == -1) {
 		png_destroy_read_struct(&png, &info, 0);
 		return -1;
 	}
@@ -104,48 +128,45 @@ static int read_file(struct img_pixmap *img, struct img_io *io)
 		cmap = img_colormap(img);
 		png_get_PLTE(png, info, &palette, &cmap->ncolors);
 		memcpy(cmap->color, palette, cmap->ncolors * sizeof *cmap->color);
-	}
 
-	lineptr = (unsigned char**)png_get_rows(png, info);
-	if(channel_bits == 8) {
-		unsigned char *dest = img->pixels;
-
-		for(i=0; i<ysz; i++) {
-			memcpy(dest, lineptr[i], xsz * img->pixelsz);
-			dest += xsz * img->pixelsz;
+		/* the tRNS chunk has the alpha of the first few palette entries */
+		memset(cmap->alpha, 0xff, sizeof cmap->alpha);
+		if(png_get_valid(png, info, PNG_INFO_tRNS)) {
+			png_get_tRNS(png, info, &trans, &num_trans, 0);
+			if(num_trans > cmap->ncolors) num_trans = cmap->ncolors;
+			memcpy(cmap->alpha, trans, num_trans);
 		}
+	}
 
-	} else if(channel_bits < 8) {
-		unsigned char *src, *dest = img->pixels;
-		unsigned char data, bit;
-
+	/* decode the scanlines straight into the pixel buffer */
+	if(!(lineptr = img_mem_alloc(ysz * sizeof *lineptr))) {
+		png_destroy_read_struct(&png, &info, 0);
+		return -1;
+	}
+	for(i=0; i<ysz; i++) {
+		lineptr[i] = (unsigned char*)img->pixels + (size_t)i * img->pitch;
+	}
+	png_read_image(png, lineptr);
+	png_read_end(png, info);
+
+	if(channel_bits == 16) {
+		/* the 16bit samples landed at the start of each row of the floating point
+		 * framebuffer. Convert them in place, iterating backwards from the end of
+		 * each row, so that we don't overwrite samples we haven't converted yet.
+		 */
+		num_elem = xsz * img->pixelsz / sizeof(float);
 		for(i=0; i<ysz; i++) {
-			src = lineptr[i];
-			bit = 0;
-			for(j=0; j<xsz; j++) {
-				if(!bit) {
-					data = *src++;
-				}
-				*dest++ = data >> (8 - channel_bits);
-				data <<= channel_bits;
-				bit += channel_bits;
-				if(bit > 8 - channel_bits) bit = 0;
-			}
-		}
+			unsigned char *src = lineptr[i] + num_elem * 2;
+			float *dest = (float*)lineptr[i] + num_elem;
 
-	} else {
-		float *dest = img->pixels;
-
-		num_elem = img->pixelsz / sizeof(float);
-		for(i=0; i<ysz; i++) {
-			for(j=0; j<xsz * num_elem; j++) {
-				unsigned short val = (lineptr[i][j * 2] << 8) | lineptr[i][j * 2 + 1];
-				*dest++ = (float)val / 65535.0;
+			for(j=0; j<num_elem; j++) {
+				src -= 2;
+				*--dest = (float)((src[0] << 8) | src[1]) / 65535.0;
 			}
 		}
 	}
 
-
+	img_mem_free(lineptr);
 	png_destroy_read_struct(&png, &info, 0);
 	return 0;
 }
@@ -156,14 +177,14 @@ static int write_file(struct img_pixmap *img, struct img_io *io)
 	png_info *info;
 	png_text txt;
 	struct img_pixmap tmpimg;
-	unsigned char **rows;
+	unsigned char **volatile rows = 0;	/* set after setjmp */
 	unsigned char *pixptr;
-	int i, coltype;
+	int i, coltype, num_trans;
 	struct img_colormap *cmap;
 
 	img_init(&tmpimg);
 
-	if(!(png = png_create_write_struct(PNG_LIBPNG_VER_STRING, 0, 0, 0))) {
+	if(!(png = create_write_struct())) {
 		return -1;
 	}
 	if(!(info = png_create_info_struct(png))) {
@@ -173,7 +194,7 @@ static int write_file(struct img_pixmap *img, struct img_io *io)
 
 	/* if the input image is floating-point, we need to convert it to integer */
 	if(img_is_float(img)) {
-		if(img_copy(&tmpimg, img) == -1) {
+		if(img_view(&tmpimg, img, 0, 0, img->width, img->height) == -1) {
 			return -1;
 		}
 		if(img_to_integer(&tmpimg) == -1) {
@@ -190,6 +211,7 @@ static int write_file(struct img_pixmap *img, struct img_io *io)
 
 	if(setjmp(png_jmpbuf(png))) {
 		png_destroy_write_struct(&png, &info);
+		img_mem_free(rows);
 		img_destroy(&tmpimg);
 		return -1;
 	}
@@ -203,9 +225,17 @@ static int write_file(struct img_pixmap *img, struct img_io *io)
 	if(img->fmt == IMG_FMT_IDX8) {
 		cmap = img_colormap(img);
 		png_set_PLTE(png, info, (png_color*)cmap->color, cmap->ncolors);
+
+		/* write the alpha of the palette up to the last translucent entry */
+		for(num_trans = cmap->ncolors; num_trans > 0; num_trans--) {
+			if(cmap->alpha[num_trans - 1] < 255) break;
+		}
+		if(num_trans > 0) {
+			png_set_tRNS(png, info, cmap->alpha, num_trans, 0);
+		}
 	}
 
-	if(!(rows = malloc(img->height * sizeof *rows))) {
+	if(!(rows = img_mem_alloc(img->height * sizeof *rows))) {
 		png_destroy_write_struct(&png, &info);
 		img_destroy(&tmpimg);
 		return -1;
@@ -214,7 +244,7 @@ static int write_file(struct img_pixmap *img, struct img_io *io)
 	pixptr = img->pixels;
 	for(i=0; i<img->height; i++) {
 		rows[i] = pixptr;
-		pixptr += img->width * img->pixelsz;
+		pixptr += img->pitch;
 	}
 	png_set_rows(png, info, rows);
 
@@ -222,12 +252,23 @@ static int write_file(struct img_pixmap *img, struct img_io *io)
 	png_write_end(png, info);
 	png_destroy_write_struct(&png, &info);
 
-	free(rows);
+	img_mem_free(rows);
 
 	img_destroy(&tmpimg);
 	return 0;
 }
 
+/* deflate usually gets photos down to somewhere around 3/4 of the filtered
+ * 8 bit raster, and anything synthetic to much less than that
+ */
+static size_t write_size(struct img_pixmap *img)
+{
+	size_t pixsz = img_is_float(img) ? img->pixelsz / 4 : img->pixelsz;
+	size_t rawsz = ((size_t)img->width * pixsz + 1) * img->height;
+
+	return rawsz / 4 * 3 + 1024;
+}
+
 static void read_func(png_struct *png, unsigned char *data, size_t len)
 {
 	struct img_io *io = (struct img_io*)png_get_io_ptr(png);
@@ -251,6 +292,18 @@ static void flush_func(png_struct *png)
 	/* XXX does it matter that we can't flush? */
 }
 
+#ifdef PNG_USER_MEM_SUPPORTED
+static png_voidp mem_alloc(png_struct *png, png_alloc_size_t sz)
+{
+	return img_mem_alloc(sz);
+}
+
+static void mem_free(png_struct *png, png_voidp ptr)
+{
+	img_mem_free(ptr);
+}
+#endif
+
 static int png_type_to_fmt(int color_type, int channel_bits)
 {
 	if(channel_bits > 8 && channel_bits != 16) {
@@ -21,6 +21,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <limits.h>
 #include "imago2.h"
 #include "ftmodule.h"
 #include "byteord.h"
@@ -28,10 +29,11 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 static int check(struct img_io *io);
 static int read(struct img_pixmap *img, struct img_io *io);
 static int write(struct img_pixmap *img, struct img_io *io);
+static size_t write_size(struct img_pixmap *img);
 
 int img_register_ppm(void)
 {
-	static struct ftype_module mod = {".ppm:.pgm:.pnm", check, read, write};
+	static struct ftype_module mod = {".ppm:.pgm:.pnm", check, read, write, write_size};
 	return img_register_module(&mod);
 }
 
@@ -54,18 +56,25 @@ static int check(struct img_io *io)
 	return res;
 }
 
-static int iofgetc(struct img_io *io)
+/* mem is the memory source of io, if any, to read from directly */
+static int iofgetc(struct img_io *io, struct img_memsrc *mem)
 {
 	char c;
+
+	if(mem) {
+		if(mem->pos >= mem->size) return -1;
+		c = mem->data[mem->pos++];
+		return c;
+	}
 	return io->read(&c, 1, io->uptr) < 1 ? -1 : c;
 }
 
-static char *iofgets(char *buf, int size, struct img_io *io)
+static char *iofgets(char *buf, int size, struct img_io *io, struct img_memsrc *mem)
 {
 	int c;
 	char *ptr = buf;
 
-	while(--size > 0 && (c = iofgetc(io)) != -1) {
+	while(--size > 0 && (c = iofgetc(io, mem)) != -1) {
 		*ptr++ = c;
 		if(c == '\n') break;
 	}
@@ -78,10 +87,11 @@ static int read(struct img_pixmap *img, struct img_io *io)
 {
 	char buf[256];
 	int xsz, ysz, maxval, got_hdrlines = 1;
-	int i, greyscale, numval, valsize, fbsize, text;
+	int i, j, greyscale, numval, valsize, rowsz, text;
 	enum img_fmt fmt;
+	struct img_memsrc *mem = img_io_memsrc(io);
 
-	if(!iofgets(buf, sizeof buf, io)) {
+	if(!iofgets(buf, sizeof buf, io, mem)) {
 		return -1;
 	}
 	if(!(buf[0] == 'P' && (buf[1] == '6' || buf[1] == '3' || buf[1] == '5'))) {
@@ -90,7 +100,7 @@ static int read(struct img_pixmap *img, struct img_io *io)
 	greyscale = buf[1] == '5' ? 1 : 0;
 	text = buf[1] == '3' ? 1 : 0;
 
-	while(got_hdrlines < 3 && iofgets(buf, sizeof buf, io)) {
+	while(got_hdrlines < 3 && iofgets(buf, sizeof buf, io, mem)) {
 		if(buf[0] == '#') continue;
 
 		switch(got_hdrlines) {
@@ -113,10 +123,14 @@ static int read(struct img_pixmap *img, struct img_io *io)
 	if(xsz < 1 || ysz < 1 || maxval <= 0 || maxval > 65535) {
 		return -1;
 	}
+	/* up to 3 values of 2 bytes per pixel, the row size below must fit in an int */
+	if(xsz > INT_MAX / 6) {
+		return -1;
+	}
 
 	valsize = maxval < 256 ? 1 : 2;
-	numval = xsz * ysz * (greyscale ? 1 : 3);
-	fbsize = numval * valsize;
+	numval = xsz * (greyscale ? 1 : 3);	/* per row */
+	rowsz = numval * valsize;
 
 	if(valsize > 1) {
 		fmt = greyscale ? IMG_FMT_GREYF : IMG_FMT_RGBF;
@@ -124,60 +138,78 @@ static int read(struct img_pixmap *img, struct img_io *io)
 		fmt = greyscale ? IMG_FMT_GREY8 : IMG_FMT_RGB24;
 	}
 
-	if(img_set_pixels(img, xsz, ysz, fmt, 0) == -1) {
+	/* with img_load_mapped, binary 8 bit pixels are used straight out of the file */
+	if(!text && maxval == 255 && mem && img_wrap_mapping(img, mem, xsz, ysz, fmt) != -1) {
+		return 0;
+	}
+
+	if(img_prepare_pixels(img, xsz, ysz, fmt) == -1) {
 		return -1;
 	}
 
 	if(!text) {
-		if(io->read(img->pixels, fbsize, io->uptr) < (unsigned int)fbsize) {
-			return -1;
-		}
-		if(maxval == 255) {
-			return 0;	/* we're done, no conversion necessary */
-		}
-
-		if(maxval < 256) {
-			unsigned char *ptr = img->pixels;
-			for(i=0; i<numval; i++) {
-				unsigned char c = *ptr * 255 / maxval;
-				*ptr++ = c;
+		for(i=0; i<ysz; i++) {
+			unsigned char *row = (unsigned char*)img->pixels + (size_t)i * img->pitch;
+
+			if(mem) {
+				if(mem->pos > mem->size || mem->size - mem->pos < (size_t)rowsz) {
+					return -1;
+				}
+				memcpy(row, mem->data + mem->pos, rowsz);
+				mem->pos += rowsz;
+			} else if(io->read(row, rowsz, io->uptr) < (unsigned int)rowsz) {
+				return -1;
+			}
+			if(maxval == 255) {
+				continue;	/* no conversion necessary */
 			}
-		} else {
-			/* we allocated a floating point framebuffer, and dropped the 16bit pixels
-			 * into it. To convert it in-place we'll iterate backwards from the end, since
-			 * otherwise each 32bit floating point value we store, would overwrite the next
-			 * pixel.
-			 */
-			uint16_t *src = (uint16_t*)img->pixels + numval;
-			float *dest = (float*)img->pixels + numval;
-
-			for(i=0; i<numval; i++) {
-				uint16_t val = *--src;
+
+			if(maxval < 256) {
+				unsigned char *ptr = row;
+				for(j=0; j<numval; j++) {
+					unsigned char c = *ptr * 255 / maxval;
+					*ptr++ = c;
+				}
+			} else {
+				/* we allocated a floating point framebuffer, and dropped the 16bit pixels
+				 * into it. To convert it in-place we'll iterate backwards from the end, since
+				 * otherwise each 32bit floating point value we store, would overwrite the next
+				 * pixel.
+				 */
+				uint16_t *src = (uint16_t*)row + numval;
+				float *dest = (float*)row + numval;
+
+				for(j=0; j<numval; j++) {
+					uint16_t val = *--src;
 #ifdef IMAGO_LITTLE_ENDIAN
-				val = (val >> 8) | (val << 8);
+					val = (val >> 8) | (val << 8);
 #endif
-				*--dest = (float)val / (float)maxval;
+					*--dest = (float)val / (float)maxval;
+				}
 			}
 		}
 	} else {
-		char *pptr = img->pixels;
-		int c = iofgetc(io);
+		int c = iofgetc(io, mem);
 
-		for(i=0; i<numval; i++) {
-			char *valptr = buf;
+		for(i=0; i<ysz; i++) {
+			char *pptr = (char*)img->pixels + (size_t)i * img->pitch;
 
-			while(c != -1 && isspace(c)) {
-				c = iofgetc(io);
-			}
+			for(j=0; j<numval; j++) {
+				char *valptr = buf;
 
-			while(c != -1 && !isspace(c) && valptr - buf < sizeof buf - 1) {
-				*valptr++ = c;
-				c = iofgetc(io);
-			}
-			if(c == -1) break;
-			*valptr = 0;
+				while(c != -1 && isspace(c)) {
+					c = iofgetc(io, mem);
+				}
+
+				while(c != -1 && !isspace(c) && valptr - buf < sizeof buf - 1) {
+					*valptr++ = c;
+					c = iofgetc(io, mem);
+				}
+				if(c == -1) break;
+				*valptr = 0;
 
-			*pptr++ = atoi(buf) * 255 / maxval;
+				*pptr++ = atoi(buf) * 255 / maxval;
+			}
 		}
 	}
 	return 0;
@@ -185,7 +217,7 @@ static int read(struct img_pixmap *img, struct img_io *io)
 
 static int write(struct img_pixmap *img, struct img_io *io)
 {
-	int i, sz, nval, res = -1;
+	int i, j, sz, nval, res = -1;
 	char buf[256];
 	float *fptr, maxfval;
 	struct img_pixmap tmpimg;
@@ -198,7 +230,7 @@ static int write(struct img_pixmap *img, struct img_io *io)
 
 	switch(img->fmt) {
 	case IMG_FMT_RGBA32:
-		if(img_copy(&tmpimg, img) == -1) {
+		if(img_view(&tmpimg, img, 0, 0, img->width, img->height) == -1) {
 			goto done;
 		}
 		if(img_convert(&tmpimg, IMG_FMT_RGB24) == -1) {
@@ -212,15 +244,17 @@ static int write(struct img_pixmap *img, struct img_io *io)
 		if(io->write(buf, strlen(buf), io->uptr) < strlen(buf)) {
 			goto done;
 		}
-		sz = img->width * img->height * nval;
-		if(io->write(img->pixels, sz, io->uptr) < (unsigned int)sz) {
-			goto done;
+		sz = img->width * nval;
+		for(i=0; i<img->height; i++) {
+			if(io->write((char*)img->pixels + (size_t)i * img->pitch, sz, io->uptr) < (unsigned int)sz) {
+				goto done;
+			}
 		}
 		res = 0;
 		break;
 
 	case IMG_FMT_RGBAF:
-		if(img_copy(&tmpimg, img) == -1) {
+		if(img_view(&tmpimg, img, 0, 0, img->width, img->height) == -1) {
 			goto done;
 		}
 		if(img_convert(&tmpimg, IMG_FMT_RGBF) == -1) {
@@ -234,16 +268,20 @@ static int write(struct img_pixmap *img, struct img_io *io)
 		if(io->write(buf, strlen(buf), io->uptr) < strlen(buf)) {
 			goto done;
 		}
-		fptr = img->pixels;
 		maxfval = 0;
-		for(i=0; i<img->width * img->height * nval; i++) {
-			float val = *fptr++;
-			if(val > maxfval) maxfval = val;
+		for(i=0; i<img->height; i++) {
+			fptr = (float*)((char*)img->pixels + (size_t)i * img->pitch);
+			for(j=0; j<img->width * nval; j++) {
+				float val = *fptr++;
+				if(val > maxfval) maxfval = val;
+			}
 		}
-		fptr = img->pixels;
-		for(i=0; i<img->width * img->height * nval; i++) {
-			uint16_t val = (uint16_t)(*fptr++ / maxfval * 65535.0);
-			img_write_uint16_be(io, val);
+		for(i=0; i<img->height; i++) {
+			fptr = (float*)((char*)img->pixels + (size_t)i * img->pitch);
+			for(j=0; j<img->width * nval; j++) {
+				uint16_t val = (uint16_t)(*fptr++ / maxfval * 65535.0);
+				img_write_uint16_be(io, val);
+			}
 		}
 		res = 0;
 		break;
@@ -256,3 +294,12 @@ done:
 	img_destroy(&tmpimg);
 	return res;
 }
+
+/* the header, and the raster at 1 or 2 bytes per value, as written above */
+static size_t write_size(struct img_pixmap *img)
+{
+	size_t nval = img_is_greyscale(img) ? 1 : 3;
+	size_t valsz = img_is_float(img) ? 2 : 1;
+
+	return 64 + (size_t)img->width * img->height * nval * valsz;
+}
@@ -17,6 +17,7 @@
 #include <errno.h>
 #include "imago2.h"
 #include "ftmodule.h"
+#include "alloc.h"
 
 
 typedef struct {
@@ -34,6 +35,7 @@ typedef struct {
 static int check(struct img_io *io);
 static int read(struct img_pixmap *img, struct img_io *io);
 static int write(struct img_pixmap *img, struct img_io *io);
+static size_t write_size(struct img_pixmap *img);
 
 static int rgbe_read_header(struct img_io *io, int *width, int *height, rgbe_header_info * info);
 static int rgbe_write_header(struct img_io *io, int width, int height, rgbe_header_info * info);
@@ -43,7 +45,7 @@ static int rgbe_write_pixels_rle(struct img_io *io, float *data, int scanline_wi
 
 int img_register_rgbe(void)
 {
-	static struct ftype_module mod = {".rgbe:.pic:.hdr", check, read, write};
+	static struct ftype_module mod = {".rgbe:.pic:.hdr", check, read, write, write_size};
 	return img_register_module(&mod);
 }
 
@@ -62,29 +64,35 @@ static int check(struct img_io *io)
 
 static int read(struct img_pixmap *img, struct img_io *io)
 {
-	int xsz, ysz;
+	int i, xsz, ysz;
 	rgbe_header_info hdr;
 
 	if(rgbe_read_header(io, &xsz, &ysz, &hdr) == -1) {
 		return -1;
 	}
 
-	if(img_set_pixels(img, xsz, ysz, IMG_FMT_RGBF, 0) == -1) {
+	if(img_prepare_pixels(img, xsz, ysz, IMG_FMT_RGBF) == -1) {
 		return -1;
 	}
-	if(rgbe_read_pixels_rle(io, img->pixels, xsz, ysz) == -1) {
-		return -1;
+	if(img->pitch == xsz * img->pixelsz) {
+		return rgbe_read_pixels_rle(io, img->pixels, xsz, ysz);
+	}
+	/* padded rows, every scanline starts with its own run-length header anyway */
+	for(i=0; i<ysz; i++) {
+		if(rgbe_read_pixels_rle(io, (float*)((char*)img->pixels + (size_t)i * img->pitch), xsz, 1) == -1) {
+			return -1;
+		}
 	}
 	return 0;
 }
 
 static int write(struct img_pixmap *img, struct img_io *io)
 {
+	int i;
 	struct img_pixmap fimg;
 
 	img_init(&fimg);
-	if(img_copy(&fimg, img) == -1) {
-		img_destroy(&fimg);
+	if(img_view(&fimg, img, 0, 0, img->width, img->height) == -1) {
 		return -1;
 	}
 	if(img_convert(&fimg, IMG_FMT_RGBF) == -1) {
@@ -96,14 +104,30 @@ static int write(struct img_pixmap *img, struct img_io *io)
 		img_destroy(&fimg);
 		return -1;
 	}
-	if(rgbe_write_pixels_rle(io, fimg.pixels, fimg.width, fimg.height) == -1) {
-		img_destroy(&fimg);
-		return -1;
+	if(fimg.pitch == fimg.width * fimg.pixelsz) {
+		if(rgbe_write_pixels_rle(io, fimg.pixels, fimg.width, fimg.height) == -1) {
+			img_destroy(&fimg);
+			return -1;
+		}
+	} else {
+		for(i=0; i<fimg.height; i++) {
+			float *row = (float*)((char*)fimg.pixels + (size_t)i * fimg.pitch);
+			if(rgbe_write_pixels_rle(io, row, fimg.width, 1) == -1) {
+				img_destroy(&fimg);
+				return -1;
+			}
+		}
 	}
 	img_destroy(&fimg);
 	return 0;
 }
 
+/* 4 bytes per pixel, which the run-length encoding rarely grows by much */
+static size_t write_size(struct img_pixmap *img)
+{
+	return (size_t)img->width * img->height * 4 + 256;
+}
+
 
 static int iofgetc(struct img_io *io)
 {
@@ -230,7 +254,9 @@ static int rgbe_write_header(struct img_io *io, int width, int height, rgbe_head
 		programtype = info->programtype;
 		ptypelen = strlen(programtype);
 	}
-	buf = malloc(ptypelen > 120 ? ptypelen + 8 : 128);
+	if(!(buf = img_mem_alloc(ptypelen > 120 ? ptypelen + 8 : 128))) {
+		return rgbe_error(rgbe_memory_error, "unable to allocate header buffer");
+	}
 	sprintf(buf, "#?%s\n", programtype);
 	if(io->write(buf, strlen(buf), io->uptr) <= 0)
 		goto err;
@@ -252,10 +278,10 @@ static int rgbe_write_header(struct img_io *io, int width, int height, rgbe_head
 	if(io->write(buf, strlen(buf), io->uptr) <= 0)
 		goto err;
 
-	free(buf);
+	img_mem_free(buf);
 	return RGBE_RETURN_SUCCESS;
 err:
-	free(buf);
+	img_mem_free(buf);
 	return rgbe_error(rgbe_write_error, NULL);
 }
 
@@ -322,7 +348,7 @@ static int rgbe_read_header(struct img_io *io, int *width, int *height, rgbe_hea
 
 /* These routines can be made faster by allocating a larger buffer and
    fread-ing and fwrite-ing the data in larger chunks */
-static int rgbe_write_pixels(struct img_io *io, float *data, int numpixels)
+static int rgbe_write_pixels(struct img_io *io, float *data, size_t numpixels)
 {
 	unsigned char rgbe[4];
 
@@ -336,7 +362,7 @@ static int rgbe_write_pixels(struct img_io *io, float *data, int numpixels)
 }
 
 /* simple read routine.  will not correctly handle run length encoding */
-static int rgbe_read_pixels(struct img_io *io, float *data, int numpixels)
+static int rgbe_read_pixels(struct img_io *io, float *data, size_t numpixels)
 {
 	unsigned char rgbe[4];
 
@@ -417,18 +443,18 @@ static int rgbe_write_pixels_rle(struct img_io *io, float *data, int scanline_wi
 
 	if((scanline_width < 8) || (scanline_width > 0x7fff))
 		/* run length encoding is not allowed so write flat */
-		return rgbe_write_pixels(io, data, scanline_width * num_scanlines);
-	buffer = (unsigned char *)malloc(sizeof(unsigned char) * 4 * scanline_width);
+		return rgbe_write_pixels(io, data, (size_t)scanline_width * num_scanlines);
+	buffer = (unsigned char *)img_mem_alloc(sizeof(unsigned char) * 4 * scanline_width);
 	if(buffer == NULL)
 		/* no buffer space so write flat */
-		return rgbe_write_pixels(io, data, scanline_width * num_scanlines);
+		return rgbe_write_pixels(io, data, (size_t)scanline_width * num_scanlines);
 	while(num_scanlines-- > 0) {
 		rgbe[0] = 2;
 		rgbe[1] = 2;
 		rgbe[2] = scanline_width >> 8;
 		rgbe[3] = scanline_width & 0xFF;
 		if(io->write(rgbe, sizeof(rgbe), io->uptr) < 1) {
-			free(buffer);
+			img_mem_free(buffer);
 			return rgbe_error(rgbe_write_error, NULL);
 		}
 		for(i = 0; i < scanline_width; i++) {
@@ -444,12 +470,12 @@ static int rgbe_write_pixels_rle(struct img_io *io, float *data, int scanline_wi
 		for(i = 0; i < 4; i++) {
 			if((err = rgbe_write_bytes_rle(io, &buffer[i * scanline_width],
 										  scanline_width)) != RGBE_RETURN_SUCCESS) {
-				free(buffer);
+				img_mem_free(buffer);
 				return err;
 			}
 		}
 	}
-	free(buffer);
+	img_mem_free(buffer);
 	return RGBE_RETURN_SUCCESS;
 }
 
@@ -461,28 +487,28 @@ static int rgbe_read_pixels_rle(struct img_io *io, float *data, int scanline_wid
 
 	if((scanline_width < 8) || (scanline_width > 0x7fff))
 		/* run length encoding is not allowed so read flat */
-		return rgbe_read_pixels(io, data, scanline_width * num_scanlines);
+		return rgbe_read_pixels(io, data, (size_t)scanline_width * num_scanlines);
 	scanline_buffer = NULL;
 	/* read in each successive scanline */
 	while(num_scanlines > 0) {
 		if(io->read(rgbe, sizeof(rgbe), io->uptr) < 1) {
-			free(scanline_buffer);
+			img_mem_free(scanline_buffer);
 			return rgbe_error(rgbe_read_error, NULL);
 		}
 		if((rgbe[0] != 2) || (rgbe[1] != 2) || (rgbe[2] & 0x80)) {
 			/* this file is not run length encoded */
 			rgbe2float(&data[0], &data[1], &data[2], rgbe);
 			data += RGBE_DATA_SIZE;
-			free(scanline_buffer);
-			return rgbe_read_pixels(io, data, scanline_width * num_scanlines - 1);
+			img_mem_free(scanline_buffer);
+			return rgbe_read_pixels(io, data, (size_t)scanline_width * num_scanlines - 1);
 		}
 		if((((int)rgbe[2]) << 8 | rgbe[3]) != scanline_width) {
-			free(scanline_buffer);
+			img_mem_free(scanline_buffer);
 			return rgbe_error(rgbe_format_error, "wrong scanline width");
 		}
 		if(scanline_buffer == NULL)
 			scanline_buffer = (unsigned char *)
-				malloc(sizeof(unsigned char) * 4 * scanline_width);
+				img_mem_alloc(sizeof(unsigned char) * 4 * scanline_width);
 		if(scanline_buffer == NULL)
 			return rgbe_error(rgbe_memory_error, "unable to allocate buffer space");
 
@@ -492,14 +518,14 @@ static int rgbe_read_pixels_rle(struct img_io *io, float *data, int scanline_wid
 			ptr_end = &scanline_buffer[(i + 1) * scanline_width];
 			while(ptr < ptr_end) {
 				if(io->read(buf, sizeof(buf[0]) * 2, io->uptr) < 1) {
-					free(scanline_buffer);
+					img_mem_free(scanline_buffer);
 					return rgbe_error(rgbe_read_error, NULL);
 				}
 				if(buf[0] > 128) {
 					/* a run of the same value */
 					count = buf[0] - 128;
 					if((count == 0) || (count > ptr_end - ptr)) {
-						free(scanline_buffer);
+						img_mem_free(scanline_buffer);
 						return rgbe_error(rgbe_format_error, "bad scanline data");
 					}
 					while(count-- > 0)
@@ -508,13 +534,13 @@ static int rgbe_read_pixels_rle(struct img_io *io, float *data, int scanline_wid
 					/* a non-run */
 					count = buf[0];
 					if((count == 0) || (count > ptr_end - ptr)) {
-						free(scanline_buffer);
+						img_mem_free(scanline_buffer);
 						return rgbe_error(rgbe_format_error, "bad scanline data");
 					}
 					*ptr++ = buf[1];
 					if(--count > 0) {
 						if(io->read(ptr, sizeof(*ptr) * count, io->uptr) < 1) {
-							free(scanline_buffer);
+							img_mem_free(scanline_buffer);
 							return rgbe_error(rgbe_read_error, NULL);
 						}
 						ptr += count;
@@ -533,6 +559,6 @@ static int rgbe_read_pixels_rle(struct img_io *io, float *data, int scanline_wid
 		}
 		num_scanlines--;
 	}
-	free(scanline_buffer);
+	img_mem_free(scanline_buffer);
 	return RGBE_RETURN_SUCCESS;
 }
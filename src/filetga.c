@@ -22,6 +22,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <stdlib.h>
 #include "imago2.h"
 #include "ftmodule.h"
+#include "alloc.h"
 #include "byteord.h"
 
 
@@ -71,13 +72,15 @@ struct tga_footer {
 static int check(struct img_io *io);
 static int read_tga(struct img_pixmap *img, struct img_io *io);
 static int write_tga(struct img_pixmap *img, struct img_io *io);
+static size_t write_size(struct img_pixmap *img);
 static int write_header(struct tga_header *hdr, struct img_io *io);
 static int read_pixel(struct img_io *io, int fmt, unsigned char *pix);
+static int read_raw_row(struct img_io *io, struct img_memsrc *mem, int fmt, unsigned char *row, int width);
 static int fmt_to_tga_type(int fmt);
 
 int img_register_tga(void)
 {
-	static struct ftype_module mod = {".tga:.targa", check, read_tga, write_tga};
+	static struct ftype_module mod = {".tga:.targa", check, read_tga, write_tga, write_size};
 	return img_register_module(&mod);
 }
 
@@ -115,8 +118,10 @@ static int read_tga(struct img_pixmap *img, struct img_io *io)
 	int rle_mode = 0, rle_pix_left = 0;
 	int pixel_bytes;
 	int alpha;
+	unsigned char *prev = 0;
 	enum img_fmt fmt;
 	struct img_colormap cmap;
+	struct img_memsrc *mem = img_io_memsrc(io);
 
 	/* read header */
 	hdr.idlen = iofgetc(io);
@@ -140,6 +145,7 @@ static int read_tga(struct img_pixmap *img, struct img_io *io)
 	/* read the color map if it exists */
 	if(hdr.cmap_type == 1) {
 		cmap.ncolors = hdr.cmap_len;
+		memset(cmap.alpha, 0xff, sizeof cmap.alpha);
 
 		for(i=0; i<hdr.cmap_len; i++) {
 			switch(hdr.cmap_entry_sz) {
@@ -199,7 +205,7 @@ static int read_tga(struct img_pixmap *img, struct img_io *io)
 		fmt = alpha ? IMG_FMT_RGBA32 : IMG_FMT_RGB24;
 	}
 
-	if(img_set_pixels(img, x, y, fmt, 0) == -1) {
+	if(img_prepare_pixels(img, x, y, fmt) == -1) {
 		return -1;
 	}
 
@@ -207,42 +213,42 @@ static int read_tga(struct img_pixmap *img, struct img_io *io)
 		unsigned char *ptr;
 		int j, k;
 
-		ptr = (unsigned char*)img->pixels + ((hdr.img_desc & 0x20) ? i : y - (i + 1)) * x * pixel_bytes;
+		ptr = (unsigned char*)img->pixels + (size_t)((hdr.img_desc & 0x20) ? i : y - (i + 1)) * img->pitch;
+
+		/* raw images are read a whole row at a time */
+		if(!IS_RLE(hdr.img_type)) {
+			if(read_raw_row(io, mem, fmt, ptr, x) == -1) {
+				return -1;
+			}
+			continue;
+		}
 
 		for(j=0; j<x; j++) {
-			/* if the image is raw, then just read the next pixel */
-			if(!IS_RLE(hdr.img_type)) {
-				if(read_pixel(io, fmt, ptr) == -1) {
-					return -1;
-				}
-			} else {
-				/* otherwise, for RLE... */
-
-				/* if we have pixels left in the packet ... */
-				if(rle_pix_left) {
-					/* if it's a raw packet, read the next pixel, otherwise keep the same */
-					if(!rle_mode) {
-						if(read_pixel(io, fmt, ptr) == -1) {
-							return -1;
-						}
-					} else {
-						for(k=0; k<pixel_bytes; k++) {
-							ptr[k] = ptr[k - pixel_bytes];
-						}
-					}
-					--rle_pix_left;
-				} else {
-					/* read RLE packet header */
-					unsigned char phdr = iofgetc(io);
-					rle_mode = (phdr & 128);		/* last bit shows the mode for this packet (1: rle, 0: raw) */
-					rle_pix_left = (phdr & ~128);	/* the rest gives the count of pixels minus one (we also read one here, so no +1) */
-					/* and read the first pixel of the packet */
+			/* if we have pixels left in the packet ... */
+			if(rle_pix_left) {
+				/* if it's a raw packet, read the next pixel, otherwise keep the same */
+				if(!rle_mode) {
 					if(read_pixel(io, fmt, ptr) == -1) {
 						return -1;
 					}
+				} else {
+					for(k=0; k<pixel_bytes; k++) {
+						ptr[k] = prev[k];
+					}
+				}
+				--rle_pix_left;
+			} else {
+				/* read RLE packet header */
+				unsigned char phdr = iofgetc(io);
+				rle_mode = (phdr & 128);		/* last bit shows the mode for this packet (1: rle, 0: raw) */
+				rle_pix_left = (phdr & ~128);	/* the rest gives the count of pixels minus one (we also read one here, so no +1) */
+				/* and read the first pixel of the packet */
+				if(read_pixel(io, fmt, ptr) == -1) {
+					return -1;
 				}
 			}
 
+			prev = ptr;
 			ptr += pixel_bytes;
 		}
 	}
@@ -270,7 +276,7 @@ static int write_tga(struct img_pixmap *img, struct img_io *io)
 
 	/* if the input image is floating-point, we need to convert it to integer */
 	if(img_is_float(img)) {
-		if(img_copy(&tmpimg, img) == -1) {
+		if(img_view(&tmpimg, img, 0, 0, img->width, img->height) == -1) {
 			goto end;
 		}
 		if(img_to_integer(&tmpimg) == -1) {
@@ -280,7 +286,7 @@ static int write_tga(struct img_pixmap *img, struct img_io *io)
 
 	} else if(img->fmt == IMG_FMT_RGB565) {
 		/* if it's 565 just convert it to RGB24 first */
-		if(img_copy(&tmpimg, img) == -1) {
+		if(img_view(&tmpimg, img, 0, 0, img->width, img->height) == -1) {
 			goto end;
 		}
 		if(img_convert(&tmpimg, IMG_FMT_RGB24) == -1) {
@@ -322,19 +328,23 @@ static int write_tga(struct img_pixmap *img, struct img_io *io)
 	}
 
 	if(img->fmt == IMG_FMT_GREY8 || img->fmt == IMG_FMT_IDX8) {
-		sz = img->height * img->width * img->pixelsz;
-		if(io->write(img->pixels, sz, io->uptr) < sz) {
-			goto end;
+		sz = img->width * img->pixelsz;
+		pixptr = img->pixels;
+		for(i=0; i<img->height; i++) {
+			if(io->write(pixptr, sz, io->uptr) < sz) {
+				goto end;
+			}
+			pixptr += img->pitch;
 		}
 	} else {
 		sz = img->width * img->pixelsz;
-		if(!(scanline = malloc(sz))) {
+		if(!(scanline = img_mem_alloc(sz))) {
 			goto end;
 		}
 
-		pixptr = img->pixels;
 		for(i=0; i<img->height; i++) {
 			unsigned char *dest = scanline;
+			pixptr = (unsigned char*)img->pixels + (size_t)i * img->pitch;
 			for(j=0; j<img->width; j++) {
 				dest[0] = pixptr[2];
 				dest[1] = pixptr[1];
@@ -346,12 +356,12 @@ static int write_tga(struct img_pixmap *img, struct img_io *io)
 				dest += img->pixelsz;
 			}
 			if(io->write(scanline, sz, io->uptr) < sz) {
-				free(scanline);
+				img_mem_free(scanline);
 				goto end;
 			}
 		}
 
-		free(scanline);
+		img_mem_free(scanline);
 	}
 
 	strcpy(foot.sig, "TRUEVISION-XFILE.");
@@ -363,6 +373,20 @@ end:
 	return res;
 }
 
+/* write_tga output is uncompressed, so this is exact, give or take the palette */
+static size_t write_size(struct img_pixmap *img)
+{
+	size_t pixsz = img->pixelsz;
+
+	if(img_is_float(img)) {
+		pixsz /= 4;
+	} else if(img->fmt == IMG_FMT_RGB565) {
+		pixsz = 3;
+	}
+	return sizeof(struct tga_header) + 256 * 3 + (size_t)img->width * img->height * pixsz
+		+ sizeof(struct tga_footer);
+}
+
 static int write_header(struct tga_header *hdr, struct img_io *io)
 {
 #ifdef IMAGO_BIG_ENDIAN
@@ -409,6 +433,37 @@ static int read_pixel(struct img_io *io, int fmt, unsigned char *pix)
 	return 0;
 }
 
+/* reads a row of uncompressed pixels into place, and swaps BGR(A) to RGB(A) */
+static int read_raw_row(struct img_io *io, struct img_memsrc *mem, int fmt, unsigned char *row, int width)
+{
+	int i, pixsz;
+	unsigned char tmp;
+	size_t sz;
+
+	pixsz = fmt == IMG_FMT_RGBA32 ? 4 : (fmt == IMG_FMT_RGB24 ? 3 : 1);
+	sz = (size_t)width * pixsz;
+
+	if(mem) {
+		if(mem->pos > mem->size || mem->size - mem->pos < sz) {
+			return -1;
+		}
+		memcpy(row, mem->data + mem->pos, sz);
+		mem->pos += sz;
+	} else if(io->read(row, sz, io->uptr) < sz) {
+		return -1;
+	}
+
+	if(pixsz > 1) {
+		for(i=0; i<width; i++) {
+			tmp = row[0];
+			row[0] = row[2];
+			row[2] = tmp;
+			row += pixsz;
+		}
+	}
+	return 0;
+}
+
 static int fmt_to_tga_type(int fmt)
 {
 	switch(fmt) {
@@ -34,6 +34,7 @@ int img_register_module(struct ftype_module *mod)
 {
 	struct list_node *node;
 
+	/* not through the user allocator: the module list lives as long as the program */
 	if(!(node = malloc(sizeof *node))) {
 		return -1;
 	}
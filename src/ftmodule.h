@@ -27,6 +27,8 @@ struct ftype_module {
 	int (*check)(struct img_io *io);
 	int (*read)(struct img_pixmap *img, struct img_io *io);
 	int (*write)(struct img_pixmap *img, struct img_io *io);
+	/* rough size of the written file, to size img_write_mem buffers (optional) */
+	size_t (*write_size)(struct img_pixmap *img);
 };
 
 int img_register_module(struct ftype_module *mod);
@@ -35,5 +37,32 @@ struct ftype_module *img_find_format_module(struct img_io *io, const char *fname
 struct ftype_module *img_guess_format(const char *fname);
 struct ftype_module *img_get_module(int idx);
 
+/* Readers call this instead of img_set_pixels, to get the pixel buffer to decode
+ * into. Normally it just allocates one, but for img_read_into it fails if the
+ * image doesn't fit in the caller's buffer, and hands out that buffer directly
+ * if the pixel format matches.
+ */
+int img_prepare_pixels(struct img_pixmap *img, int w, int h, enum img_fmt fmt);
+
+/* The source of img_read_mem. Readers can take the data straight out of the
+ * buffer, instead of calling io->read, as long as they advance pos past
+ * whatever they consume (io->read and io->seek still work, and use pos too).
+ */
+struct img_memsrc {
+	const unsigned char *data;
+	size_t size, pos;
+	void *map;	/* for img_load_mapped, the private file mapping of data */
+};
+
+/* returns the memory source io reads from, or null if it doesn't read from memory */
+struct img_memsrc *img_io_memsrc(struct img_io *io);
+
+/* For img_load_mapped: makes the pixels of img point into the file mapping of
+ * mem, at the current position, without copying them, and advances pos past
+ * them. The pixmap takes over the mapping. Returns -1 if there's no mapping to
+ * take, or not enough data left in it, so the reader has to copy the pixels.
+ */
+int img_wrap_mapping(struct img_pixmap *img, struct img_memsrc *mem, int w, int h, enum img_fmt fmt);
+
 
 #endif	/* FTYPE_MODULE_H_ */
@@ -19,18 +19,56 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include "imago2.h"
 #include "ftmodule.h"
 #include "byteord.h"
+#include "conv.h"
+#include "alloc.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define USE_MMAP
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+/* internal pixmap flag, set while img_read_into is decoding into a caller buffer */
+#define IMG_READ_INTO	0x8000
 
 /* calculate int-aligned offset to colormap, right after the end of the pixel data */
 #define CMAPPTR(fb, fbsz)	\
 	(struct img_colormap*)((((uintptr_t)fb) + (fbsz) + sizeof(int) - 1) & ~(sizeof(int) - 1))
 
-static int pixel_size(enum img_fmt fmt);
 static size_t def_read(void *buf, size_t bytes, void *uptr);
 static size_t def_write(void *buf, size_t bytes, void *uptr);
 static long def_seek(long offset, int whence, void *uptr);
+static size_t mem_read(void *buf, size_t bytes, void *uptr);
+static long mem_seek(long offset, int whence, void *uptr);
+static size_t memdest_write(void *buf, size_t bytes, void *uptr);
+static long memdest_seek(long offset, int whence, void *uptr);
+static long seek_pos(size_t *pos, size_t size, long offset, int whence);
+static struct ftype_module *write_module(const char *fname);
+static int read_memsrc(struct img_pixmap *img, struct img_memsrc *mem);
+static int load(struct img_pixmap *img, const char *fname, int keep_map);
+#ifdef USE_MMAP
+static int load_mapped(struct img_pixmap *img, const char *fname, int fd, int keep_map);
+static void unmap_pixels(void *pix, void *cls);
+
+/* a file mapping kept by a pixmap, see img_wrap_mapping */
+struct mapping {
+	void *addr;
+	size_t size;
+};
+#endif
+
+/* the destination of img_write_mem */
+struct img_memdest {
+	unsigned char *data;
+	size_t size, cap, pos;
+	int err;
+};
 
 
 void img_init(struct img_pixmap *img)
@@ -38,24 +76,28 @@ void img_init(struct img_pixmap *img)
 	img->pixels = 0;
 	img->width = img->height = 0;
 	img->fmt = IMG_FMT_RGBA32;
-	img->pixelsz = pixel_size(img->fmt);
+	img->pixelsz = img_pixel_size(img->fmt);
 	img->name = 0;
+	img->pitch = 0;
+	img->flags = 0;
+	img->cmap = 0;
+	img->release = 0;
+	img->release_cls = 0;
 }
 
 
 void img_destroy(struct img_pixmap *img)
 {
-	free(img->pixels);
-	img->pixels = 0;	/* just in case... */
+	img_release_pixels(img);	/* also sets pixels to null, just in case... */
 	img->width = img->height = 0xbadbeef;
-	free(img->name);
+	img_mem_free(img->name);
 }
 
 struct img_pixmap *img_create(void)
 {
 	struct img_pixmap *p;
 
-	if(!(p = malloc(sizeof *p))) {
+	if(!(p = img_mem_alloc(sizeof *p))) {
 		return 0;
 	}
 	img_init(p);
@@ -65,17 +107,18 @@ struct img_pixmap *img_create(void)
 void img_free(struct img_pixmap *img)
 {
 	img_destroy(img);
-	free(img);
+	img_mem_free(img);
 }
 
 int img_set_name(struct img_pixmap *img, const char *name)
 {
 	char *tmp;
 
-	if(!(tmp = malloc(strlen(name) + 1))) {
+	if(!(tmp = img_mem_alloc(strlen(name) + 1))) {
 		return -1;
 	}
 	strcpy(tmp, name);
+	img_mem_free(img->name);
 	img->name = tmp;
 	return 0;
 }
@@ -91,8 +134,26 @@ int img_set_format(struct img_pixmap *img, enum img_fmt fmt)
 
 int img_copy(struct img_pixmap *dest, struct img_pixmap *src)
 {
-	if(img_set_pixels(dest, src->width, src->height, src->fmt, src->pixels) == -1) {
-		return -1;
+	int i, rowsz;
+	unsigned char *sptr, *dptr;
+
+	if(src->pitch == src->width * src->pixelsz) {
+		if(img_set_pixels(dest, src->width, src->height, src->fmt, src->pixels) == -1) {
+			return -1;
+		}
+	} else {
+		/* the copy is always tightly packed */
+		if(img_set_pixels(dest, src->width, src->height, src->fmt, 0) == -1) {
+			return -1;
+		}
+		rowsz = dest->pitch;
+		sptr = src->pixels;
+		dptr = dest->pixels;
+		for(i=0; i<src->height; i++) {
+			memcpy(dptr, sptr, rowsz);
+			sptr += src->pitch;
+			dptr += rowsz;
+		}
 	}
 
 	if(src->fmt == IMG_FMT_IDX8) {
@@ -102,40 +163,117 @@ int img_copy(struct img_pixmap *dest, struct img_pixmap *src)
 }
 
 int img_set_pixels(struct img_pixmap *img, int w, int h, enum img_fmt fmt, void *pix)
+{
+	return img_set_pixels_pitch(img, w, h, fmt, 0, pix);
+}
+
+int img_set_pixels_pitch(struct img_pixmap *img, int w, int h, enum img_fmt fmt, int pitch, void *pix)
 {
 	void *newpix;
 	int pixsz;
-	long bsz;
+	size_t sz, bsz;
 
-	/* check if the dimensions are ridiculous and can overflow the size calculation */
-	if(w > 23170 || h > 23170) {
+	if(!(pixsz = img_pixel_size(fmt))) {
+		return -1;	/* invalid pixel format */
+	}
+	if(!pitch) {
+		if(w < 0 || w > INT_MAX / pixsz) {
+			return -1;
+		}
+		pitch = w * pixsz;
+	}
+	if(img_pixels_size(w, h, pixsz, pitch, &sz) == -1) {
 		return -1;
 	}
-
-	pixsz = pixel_size(fmt);
-	bsz = (long)w * (long)h * (long)pixsz;
+	bsz = sz;
 
 	if(fmt == IMG_FMT_IDX8) {
 		/* add space for the colormap, and space to align it to sizeof(int) */
+		if(bsz > (size_t)-1 - (sizeof(struct img_colormap) + sizeof(int) - 1)) {
+			return -1;
+		}
 		bsz += sizeof(struct img_colormap) + sizeof(int) - 1;
 	}
 
-	if(!(newpix = malloc(bsz))) {
+	if(!(newpix = img_pixbuf_alloc(bsz))) {
 		return -1;
 	}
 
 	if(pix) {
-		memcpy(newpix, pix, w * h * pixsz);
+		memcpy(newpix, pix, sz);
 	} else {
 		memset(newpix, 0, bsz);
 	}
+	if(fmt == IMG_FMT_IDX8) {
+		memset((CMAPPTR(newpix, sz))->alpha, 0xff, 256);
+	}
 
-	free(img->pixels);
+	img_release_pixels(img);
 	img->pixels = newpix;
 	img->width = w;
 	img->height = h;
 	img->pixelsz = pixsz;
+	img->pitch = pitch;
+	img->fmt = fmt;
+	return 0;
+}
+
+int img_wrap_pixels(struct img_pixmap *img, int w, int h, enum img_fmt fmt, int pitch, void *pix,
+		void (*release)(void*, void*), void *cls)
+{
+	int pixsz = img_pixel_size(fmt);
+	size_t sz;
+
+	if(!pixsz) {
+		return -1;	/* invalid pixel format */
+	}
+	if(!pitch) {
+		if(w < 0 || w > INT_MAX / pixsz) {
+			return -1;
+		}
+		pitch = w * pixsz;
+	}
+	if(img_pixels_size(w, h, pixsz, pitch, &sz) == -1) {
+		return -1;
+	}
+
+	img_release_pixels(img);
+	img->pixels = pix;
+	img->width = w;
+	img->height = h;
 	img->fmt = fmt;
+	img->pixelsz = pixsz;
+	img->pitch = pitch;
+	if(release) {
+		img->release = release;
+		img->release_cls = cls;
+	} else {
+		img->flags |= IMG_BORROWED;
+	}
+	return 0;
+}
+
+int img_view(struct img_pixmap *view, struct img_pixmap *img, int x, int y, int w, int h)
+{
+	if(x < 0 || y < 0 || w < 0 || h < 0 || x > img->width || y > img->height) {
+		return -1;
+	}
+	if(w > img->width - x || h > img->height - y) {
+		return -1;
+	}
+	if(view == img || !img->pixels) {
+		return -1;
+	}
+
+	img_release_pixels(view);
+	view->pixels = (char*)img->pixels + (size_t)y * img->pitch + (size_t)x * img->pixelsz;
+	view->width = w;
+	view->height = h;
+	view->fmt = img->fmt;
+	view->pixelsz = img->pixelsz;
+	view->pitch = img->pitch;
+	view->flags |= IMG_BORROWED;
+	view->cmap = img_colormap(img);
 	return 0;
 }
 
@@ -157,6 +295,7 @@ void *img_load_pixels(const char *fname, int *xsz, int *ysz, enum img_fmt fmt)
 
 	*xsz = img.width;
 	*ysz = img.height;
+	img_mem_free(img.name);
 	return img.pixels;
 }
 
@@ -166,31 +305,55 @@ int img_save_pixels(const char *fname, void *pix, int xsz, int ysz, enum img_fmt
 	struct img_pixmap img;
 
 	img_init(&img);
-	img.fmt = fmt;
-	img.pixelsz = pixel_size(fmt);
-	img.width = xsz;
-	img.height = ysz;
-	img.pixels = pix;
+	if(img_wrap_pixels(&img, xsz, ysz, fmt, 0, pix, 0, 0) == -1) {
+		return -1;
+	}
 
 	res = img_save(&img, fname);
-	img.pixels = 0;
 	img_destroy(&img);
 	return res;
 }
 
 void img_free_pixels(void *pix)
 {
-	free(pix);
+	img_mem_free(pix);
 }
 
 int img_load(struct img_pixmap *img, const char *fname)
+{
+	return load(img, fname, 0);
+}
+
+int img_load_mapped(struct img_pixmap *img, const char *fname)
+{
+	return load(img, fname, 1);
+}
+
+static int load(struct img_pixmap *img, const char *fname, int keep_map)
 {
 	int res;
 	FILE *fp;
 
+#ifdef USE_MMAP
+	int fd;
+
+	if((fd = open(fname, O_RDONLY)) == -1) {
+		return -1;
+	}
+	/* regular files are mapped, and read from memory */
+	if((res = load_mapped(img, fname, fd, keep_map)) != 1) {
+		close(fd);
+		return res;
+	}
+	if(!(fp = fdopen(fd, "rb"))) {
+		close(fd);
+		return -1;
+	}
+#else
 	if(!(fp = fopen(fname, "rb"))) {
 		return -1;
 	}
+#endif
 	img_set_name(img, fname);
 	res = img_read_file(img, fp);
 	fclose(fp);
@@ -229,6 +392,69 @@ int img_write_file(struct img_pixmap *img, FILE *fp)
 	return img_write(img, &io);
 }
 
+int img_read_mem(struct img_pixmap *img, const void *ptr, size_t size)
+{
+	struct img_memsrc mem;
+
+	mem.data = ptr;
+	mem.size = size;
+	mem.pos = 0;
+	mem.map = 0;
+	return read_memsrc(img, &mem);
+}
+
+static int read_memsrc(struct img_pixmap *img, struct img_memsrc *mem)
+{
+	struct img_io io = {0, mem_read, 0, mem_seek};
+
+	io.uptr = mem;
+	return img_read(img, &io);
+}
+
+void *img_write_mem(struct img_pixmap *img, const char *fname, size_t *size)
+{
+	struct ftype_module *mod;
+	struct img_memdest mem;
+	struct img_io io = {0, 0, memdest_write, memdest_seek};
+	void *tmp;
+
+	if(!(mod = write_module(fname ? fname : img->name))) {
+		return 0;
+	}
+
+	/* start with the module's guess of the output size, so that most images are
+	 * written without growing the buffer
+	 */
+	if(mod->write_size) {
+		mem.cap = mod->write_size(img);
+	} else {
+		mem.cap = (size_t)img->width * img->height * img->pixelsz + 1024;
+	}
+	if(!(mem.data = img_mem_alloc(mem.cap))) {
+		return 0;
+	}
+	mem.size = mem.pos = 0;
+	mem.err = 0;
+
+	io.uptr = &mem;
+	if(mod->write(img, &io) == -1 || mem.err || !mem.size) {
+		img_mem_free(mem.data);
+		return 0;
+	}
+
+	/* give back the excess if the guess was way off */
+	if(mem.cap - mem.size > mem.cap / 4 && (tmp = img_mem_realloc(mem.data, mem.size))) {
+		mem.data = tmp;
+	}
+	*size = mem.size;
+	return mem.data;
+}
+
+struct img_memsrc *img_io_memsrc(struct img_io *io)
+{
+	return io->read == mem_read ? io->uptr : 0;
+}
+
 int img_read(struct img_pixmap *img, struct img_io *io)
 {
 	struct ftype_module *mod;
@@ -239,21 +465,87 @@ int img_read(struct img_pixmap *img, struct img_io *io)
 	return -1;
 }
 
-int img_write(struct img_pixmap *img, struct img_io *io)
+int img_read_into(struct img_pixmap *img, struct img_io *io, void *pix, int maxw, int maxh,
+		int pitch, enum img_fmt fmt)
 {
-	struct ftype_module *mod;
+	int pixsz;
+	struct img_pixmap dest;
 
-	if(!img->name || !(mod = img_guess_format(img->name))) {
-		/* TODO throw some sort of warning? */
-		/* TODO implement some sort of module priority or let the user specify? */
-		if(!(mod = img_get_module(0))) {
+	if(fmt == IMG_FMT_IDX8 || (pixsz = img_pixel_size(fmt)) <= 0) {
+		return -1;
+	}
+	if(maxw < 0 || maxw > INT_MAX / pixsz) {
+		return -1;
+	}
+	/* resolve the pitch here, so that a converted image gets the same row layout */
+	if(!pitch) {
+		pitch = maxw * pixsz;
+	}
+	if(img_wrap_pixels(img, maxw, maxh, fmt, pitch, pix, 0, 0) == -1) {
+		return -1;
+	}
+	img->flags |= IMG_READ_INTO;
+
+	if(img_read(img, io) == -1) {
+		img_release_pixels(img);
+		return -1;
+	}
+
+	if(img->pixels != pix) {
+		/* the reader decoded it into a temporary buffer in a different format */
+		img_init(&dest);
+		if(img_wrap_pixels(&dest, img->width, img->height, fmt, pitch, pix, 0, 0) == -1 ||
+				img_convert_into(&dest, img) == -1) {
+			img_release_pixels(img);
 			return -1;
 		}
+		dest.name = img->name;
+		img->name = 0;
+		img_destroy(img);
+		*img = dest;
 	}
+	img->flags &= ~IMG_READ_INTO;
+	return 0;
+}
 
+int img_prepare_pixels(struct img_pixmap *img, int w, int h, enum img_fmt fmt)
+{
+	if(img->flags & IMG_READ_INTO) {
+		if(w > img->width || h > img->height) {
+			return -1;
+		}
+		if(fmt == img->fmt) {
+			img->width = w;
+			img->height = h;
+			return 0;
+		}
+		/* otherwise decode into a temporary, and img_read_into will convert it */
+	}
+	return img_set_pixels(img, w, h, fmt, 0);
+}
+
+int img_write(struct img_pixmap *img, struct img_io *io)
+{
+	struct ftype_module *mod;
+
+	if(!(mod = write_module(img->name))) {
+		return -1;
+	}
 	return mod->write(img, io);
 }
 
+static struct ftype_module *write_module(const char *fname)
+{
+	struct ftype_module *mod;
+
+	if(!fname || !(mod = img_guess_format(fname))) {
+		/* TODO throw some sort of warning? */
+		/* TODO implement some sort of module priority or let the user specify? */
+		mod = img_get_module(0);
+	}
+	return mod;
+}
+
 int img_to_float(struct img_pixmap *img)
 {
 	enum img_fmt targ_fmt;
@@ -323,13 +615,13 @@ int img_is_greyscale(struct img_pixmap *img)
 
 void img_setpixel(struct img_pixmap *img, int x, int y, void *pixel)
 {
-	char *dest = (char*)img->pixels + (y * img->width + x) * img->pixelsz;
+	char *dest = (char*)img->pixels + (size_t)y * img->pitch + (size_t)x * img->pixelsz;
 	memcpy(dest, pixel, img->pixelsz);
 }
 
 void img_getpixel(struct img_pixmap *img, int x, int y, void *pixel)
 {
-	char *dest = (char*)img->pixels + (y * img->width + x) * img->pixelsz;
+	char *dest = (char*)img->pixels + (size_t)y * img->pitch + (size_t)x * img->pixelsz;
 	memcpy(pixel, dest, img->pixelsz);
 }
 
@@ -428,8 +720,11 @@ struct img_colormap *img_colormap(struct img_pixmap *img)
 	if(img->fmt != IMG_FMT_IDX8 || !img->pixels) {
 		return 0;
 	}
+	if(img->cmap) {
+		return img->cmap;
+	}
 
-	return CMAPPTR(img->pixels, img->width * img->height * img->pixelsz);
+	return CMAPPTR(img->pixels, (size_t)img->height * img->pitch);
 }
 
 void img_io_set_user_data(struct img_io *io, void *uptr)
@@ -453,7 +748,23 @@ void img_io_set_seek_func(struct img_io *io, long (*seek)(long, int, void*))
 }
 
 
-static int pixel_size(enum img_fmt fmt)
+void img_release_pixels(struct img_pixmap *img)
+{
+	if(img->pixels && !(img->flags & IMG_BORROWED)) {
+		if(img->release) {
+			img->release(img->pixels, img->release_cls);
+		} else {
+			img_mem_free(img->pixels);
+		}
+	}
+	img->pixels = 0;
+	img->flags &= ~(IMG_BORROWED | IMG_READ_INTO);
+	img->cmap = 0;
+	img->release = 0;
+	img->release_cls = 0;
+}
+
+int img_pixel_size(enum img_fmt fmt)
 {
 	switch(fmt) {
 	case IMG_FMT_GREY8:
@@ -478,6 +789,18 @@ static int pixel_size(enum img_fmt fmt)
 	return 0;
 }
 
+int img_pixels_size(int w, int h, int pixsz, int pitch, size_t *res)
+{
+	if(pixsz <= 0 || w < 0 || h < 0 || w > INT_MAX / pixsz || pitch < w * pixsz) {
+		return -1;
+	}
+	if(h > 0 && (size_t)pitch > (size_t)-1 / (size_t)h) {
+		return -1;
+	}
+	*res = (size_t)pitch * (size_t)h;
+	return 0;
+}
+
 static size_t def_read(void *buf, size_t bytes, void *uptr)
 {
 	return uptr ? fread(buf, 1, bytes, uptr) : 0;
@@ -496,3 +819,197 @@ static long def_seek(long offset, int whence, void *uptr)
 	return ftell(uptr);
 }
 
+static size_t mem_read(void *buf, size_t bytes, void *uptr)
+{
+	struct img_memsrc *mem = uptr;
+
+	if(mem->pos >= mem->size) {
+		return 0;
+	}
+	if(bytes > mem->size - mem->pos) {
+		bytes = mem->size - mem->pos;
+	}
+	memcpy(buf, mem->data + mem->pos, bytes);
+	mem->pos += bytes;
+	return bytes;
+}
+
+static long mem_seek(long offset, int whence, void *uptr)
+{
+	struct img_memsrc *mem = uptr;
+	return seek_pos(&mem->pos, mem->size, offset, whence);
+}
+
+static size_t memdest_write(void *buf, size_t bytes, void *uptr)
+{
+	size_t newcap;
+	unsigned char *tmp;
+	struct img_memdest *mem = uptr;
+
+	if(bytes > (size_t)-1 - mem->pos) {
+		mem->err = 1;
+		return 0;
+	}
+	if(mem->pos + bytes > mem->cap) {
+		newcap = mem->cap * 2;
+		if(newcap < mem->pos + bytes) {
+			newcap = mem->pos + bytes;
+		}
+		if(!(tmp = img_mem_realloc(mem->data, newcap))) {
+			mem->err = 1;
+			return 0;
+		}
+		mem->data = tmp;
+		mem->cap = newcap;
+	}
+
+	if(mem->pos > mem->size) {
+		/* seeked past the end, fill the gap with zeros, like a file */
+		memset(mem->data + mem->size, 0, mem->pos - mem->size);
+	}
+	memcpy(mem->data + mem->pos, buf, bytes);
+	mem->pos += bytes;
+	if(mem->pos > mem->size) {
+		mem->size = mem->pos;
+	}
+	return bytes;
+}
+
+static long memdest_seek(long offset, int whence, void *uptr)
+{
+	struct img_memdest *mem = uptr;
+	return seek_pos(&mem->pos, mem->size, offset, whence);
+}
+
+#ifdef USE_MMAP
+/* returns 1 if the file can't be mapped (not a regular file, empty, etc), to
+ * fall back to reading it through stdio
+ */
+static int load_mapped(struct img_pixmap *img, const char *fname, int fd, int keep_map)
+{
+	int res;
+	struct stat st;
+	void *ptr;
+	size_t size;
+	struct img_memsrc mem;
+
+	if(fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size <= 0 ||
+			(unsigned long long)st.st_size > (size_t)-1) {
+		return 1;
+	}
+	size = (size_t)st.st_size;
+
+	if(keep_map) {
+		/* the pixels might end up in the mapping, and be written to: make it a
+		 * private copy-on-write mapping, and leave the access pattern unknown
+		 */
+		ptr = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		if(ptr == MAP_FAILED) {
+			return 1;
+		}
+	} else {
+#ifdef POSIX_FADV_SEQUENTIAL
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+		ptr = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(ptr == MAP_FAILED) {
+			return 1;
+		}
+		madvise(ptr, size, MADV_SEQUENTIAL);
+	}
+
+	mem.data = ptr;
+	mem.size = size;
+	mem.pos = 0;
+	mem.map = keep_map ? ptr : 0;
+
+	img_set_name(img, fname);
+	res = read_memsrc(img, &mem);
+
+	/* unless the reader kept it for the pixels */
+	if(!keep_map || mem.map) {
+		munmap(ptr, size);
+	}
+	return res;
+}
+
+static void unmap_pixels(void *pix, void *cls)
+{
+	struct mapping *map = cls;
+
+	munmap(map->addr, map->size);
+	img_mem_free(map);
+}
+#endif	/* USE_MMAP */
+
+int img_wrap_mapping(struct img_pixmap *img, struct img_memsrc *mem, int w, int h, enum img_fmt fmt)
+{
+#ifdef USE_MMAP
+	size_t sz;
+	int pixsz, pitch;
+	struct mapping *map;
+
+	if(!mem->map || (img->flags & IMG_READ_INTO) || mem->pos > mem->size) {
+		return -1;
+	}
+	pixsz = img_pixel_size(fmt);
+	if(w < 0 || (pixsz > 0 && w > INT_MAX / pixsz)) {
+		return -1;
+	}
+	pitch = w * pixsz;
+	if(img_pixels_size(w, h, pixsz, pitch, &sz) == -1 || mem->size - mem->pos < sz) {
+		return -1;
+	}
+
+	if(!(map = img_mem_alloc(sizeof *map))) {
+		return -1;
+	}
+	map->addr = mem->map;
+	map->size = mem->size;
+
+	if(img_wrap_pixels(img, w, h, fmt, pitch, (char*)mem->map + mem->pos, unmap_pixels, map) == -1) {
+		img_mem_free(map);
+		return -1;
+	}
+	mem->map = 0;	/* it's the pixmap's now */
+	mem->pos += sz;
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+static long seek_pos(size_t *pos, size_t size, long offset, int whence)
+{
+	size_t base, back;
+
+	switch(whence) {
+	case SEEK_SET:
+		base = 0;
+		break;
+	case SEEK_CUR:
+		base = *pos;
+		break;
+	case SEEK_END:
+		base = size;
+		break;
+	default:
+		return -1;
+	}
+
+	/* like fseek, it's fine to go past the end, but not before the start */
+	if(offset >= 0) {
+		if(base > (size_t)LONG_MAX || (size_t)offset > (size_t)LONG_MAX - base) {
+			return -1;
+		}
+		*pos = base + (size_t)offset;
+	} else {
+		back = (size_t)-(offset + 1) + 1;	/* -offset, without overflowing */
+		if(back > base || base - back > (size_t)LONG_MAX) {
+			return -1;
+		}
+		*pos = base - back;
+	}
+	return (long)*pos;
+}
+
@@ -27,7 +27,9 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define IMG_OPTARG(arg, val)	arg
 #endif
 
-/* XXX if you change this make sure to also change pack/unpack arrays in conv.c */
+/* XXX if you change this make sure to also change the format lists and conversion
+ * tables in conv.c
+ */
 enum img_fmt {
 	IMG_FMT_GREY8,
 	IMG_FMT_RGB24,
@@ -48,12 +50,29 @@ enum img_dither {
 	IMG_DITHER_FLOYD_STEINBERG
 };
 
+enum img_quantizer {
+	IMG_QUANT_OCTREE,
+	IMG_QUANT_MEDIAN_CUT
+};
+
+/* img_pixmap flags */
+enum {
+	IMG_BORROWED = 1	/* the pixel buffer is not owned by the pixmap, and never freed by it */
+};
+
 struct img_pixmap {
 	void *pixels;
 	int width, height;
 	enum img_fmt fmt;
 	int pixelsz;
 	char *name;
+	int pitch;	/* bytes from the start of one row to the next (>= width * pixelsz) */
+	unsigned int flags;
+	struct img_colormap *cmap;	/* if not null, overrides the colormap after the pixels */
+
+	/* called instead of free, to get rid of pixels attached with img_wrap_pixels */
+	void (*release)(void *pixels, void *cls);
+	void *release_cls;
 };
 
 struct img_colormap {
@@ -61,6 +80,7 @@ struct img_colormap {
 	struct {
 		unsigned char r, g, b;
 	} color[256];
+	unsigned char alpha[256];	/* opacity of each color, 255 for opaque */
 };
 
 struct img_io {
@@ -107,6 +127,34 @@ int img_copy(struct img_pixmap *dest, struct img_pixmap *src);
  */
 int img_set_pixels(struct img_pixmap *img, int w, int h, IMG_OPTARG(enum img_fmt fmt, IMG_FMT_RGBA32), IMG_OPTARG(void *pix, 0));
 
+/* same as img_set_pixels, but each row of the pixel buffer is pitch bytes long,
+ * which must be at least w * img_pixel_size(fmt). Use this to pad rows for
+ * alignment. If pitch is 0, the rows are tightly packed. If pix is not null,
+ * it's expected to have the same pitch.
+ */
+int img_set_pixels_pitch(struct img_pixmap *img, int w, int h, enum img_fmt fmt, int pitch, void *pix);
+
+/* Attaches an existing pixel buffer to the pixmap, without copying it. Rows are
+ * pitch bytes apart (0 means tightly packed).
+ * If release is null, the buffer is borrowed (IMG_BORROWED): the pixmap never
+ * writes to it or frees it, and the caller must keep it around for as long as
+ * the pixmap uses it. Otherwise the pixmap takes ownership of the buffer, and
+ * calls release(pix, cls) when it's done with it, instead of free.
+ * For IMG_FMT_IDX8, the colormap is expected right after the pixels, just like
+ * in buffers allocated by img_set_pixels.
+ */
+int img_wrap_pixels(struct img_pixmap *img, int w, int h, enum img_fmt fmt, int pitch, void *pix,
+		IMG_OPTARG(void (*release)(void*, void*), 0), IMG_OPTARG(void *cls, 0));
+
+/* Makes view refer to the w x h rectangle at (x, y) of the pixels of img,
+ * without copying anything. The view shares the pixel buffer (and colormap) of
+ * img, so changes to one are visible in the other, and it must not outlive img.
+ * Converting or otherwise replacing the pixels of a view, gives it its own
+ * buffer and leaves img intact. Returns -1 if the rectangle is out of bounds,
+ * or img has no pixels.
+ */
+int img_view(struct img_pixmap *view, struct img_pixmap *img, int x, int y, int w, int h);
+
 /* Simplified image loading
  * Loads the specified file, and returns a pointer to an array of pixels of the
  * requested pixel format. The width and height of the image are returned through
@@ -126,11 +174,21 @@ void *img_load_pixels(const char *fname, int *xsz, int *ysz, IMG_OPTARG(enum img
  */
 int img_save_pixels(const char *fname, void *pix, int xsz, int ysz, IMG_OPTARG(enum img_fmt fmt, IMG_FMT_RGBA32));
 
-/* Frees the memory allocated by img_load_pixels */
+/* Frees the memory allocated by img_load_pixels and img_write_mem */
 void img_free_pixels(void *pix);
 
-/* Loads an image file into the supplied pixmap */
+/* Loads an image file into the supplied pixmap. Where possible (regular files on
+ * UNIX), the file is mapped into memory and read like with img_read_mem.
+ */
 int img_load(struct img_pixmap *img, const char *fname);
+/* Like img_load, but for files holding pixels which can be used as they are
+ * (binary PGM/PPM with a maxval of 255), the pixmap is made to point straight
+ * into a private mapping of the file, instead of reading them in: loading is
+ * instant, and pages are read in lazily as they're accessed. Writing to the
+ * pixels doesn't change the file, but the file must not be truncated while the
+ * pixmap uses it. All other files are just loaded like with img_load.
+ */
+int img_load_mapped(struct img_pixmap *img, const char *fname);
 /* Saves the supplied pixmap to a file. The output filetype is guessed by the filename suffix */
 int img_save(struct img_pixmap *img, const char *fname);
 
@@ -139,22 +197,114 @@ int img_read_file(struct img_pixmap *img, FILE *fp);
 /* Writes the supplied pixmap to an open FILE* */
 int img_write_file(struct img_pixmap *img, FILE *fp);
 
+/* Reads an image from size bytes of memory, which the readers that can decode
+ * straight out of the buffer (JPEG, PPM/PGM, TGA) do, instead of copying it
+ * through their own. The buffer is not used after the call returns.
+ * As with all the img_read functions, if the format can't be detected from the
+ * data, the suffix of the pixmap name (see img_set_name) is used instead. TGA
+ * files can only be detected by the optional TGA 2.0 footer, so for TGA data
+ * without one, call img_set_name(img, ".tga") first.
+ */
+int img_read_mem(struct img_pixmap *img, const void *ptr, size_t size);
+/* Writes the supplied pixmap to a newly allocated buffer, and returns it (or
+ * null on failure) with its size in *size. The output filetype is guessed by
+ * the suffix of fname (which can be just the suffix, like ".png"), or by the
+ * name of the pixmap if fname is null. Free the buffer with img_free_pixels.
+ */
+void *img_write_mem(struct img_pixmap *img, const char *fname, size_t *size);
+
 /* Reads an image using user-defined file-i/o functions (see img_io_set_*) */
 int img_read(struct img_pixmap *img, struct img_io *io);
 /* Writes an image using user-defined file-i/o functions (see img_io_set_*) */
 int img_write(struct img_pixmap *img, struct img_io *io);
 
+/* Reads an image into a caller-supplied buffer, instead of allocating one.
+ * The buffer has room for up to maxh rows, pitch bytes apart, of up to maxw
+ * pixels of format fmt (which can't be IMG_FMT_IDX8). If the image doesn't fit,
+ * it fails without writing anything. Images in other pixel formats are converted
+ * as they're copied into the buffer. On success, img describes the image in the
+ * buffer, which stays borrowed (see img_wrap_pixels).
+ */
+int img_read_into(struct img_pixmap *img, struct img_io *io, void *pix, int maxw, int maxh,
+		int pitch, enum img_fmt fmt);
+
 /* Converts an image to the specified pixel format */
 int img_convert(struct img_pixmap *img, enum img_fmt tofmt);
 
+/* Sets the maximum number of threads used internally to process large images
+ * (in bands of rows). Images below a certain size are always processed on the
+ * calling thread.
+ * 0 (the default) means one thread per CPU, 1 disables multithreading.
+ */
+void img_set_num_threads(int n);
+/* Returns the number of threads that will be used for large images */
+int img_get_num_threads(void);
+
+/* Sets the functions used for all memory allocations done by libimago: pixel
+ * buffers and internal scratch memory alike. allocfn and reallocfn must return
+ * memory aligned to at least align bytes (0 means no particular alignment),
+ * and reallocfn must leave the original block intact if it fails. cls is passed
+ * to all three. Passing null functions restores the defaults.
+ * Set it before using the library, and keep it for as long as any pixels it
+ * allocated are around (including those returned by img_load_pixels).
+ */
+void img_set_allocator(void *(*allocfn)(size_t sz, size_t align, void *cls),
+		void *(*reallocfn)(void *ptr, size_t sz, size_t align, void *cls),
+		void (*freefn)(void *ptr, void *cls), void *cls);
+/* Sets the alignment of pixel buffers allocated by libimago, which must be a
+ * power of two. 0 (the default) leaves it up to the allocator.
+ */
+int img_set_pixel_alignment(int align);
+
 /* Quantize an image to a have at most certain maximum number of colors,
  * converting it to IMG_FMT_IDX8 in the process.
  * The number of colors must be at most 256.
+ * Images with an alpha channel are quantized in RGBA space, with the opacity of
+ * each palette color in the alpha array of the colormap; those always use
+ * median cut (and k-means refinement if enabled), regardless of the quantizer.
+ * Images in any pixel format are read as they are, converting a row at a time,
+ * so apart from the new IDX8 image and the fixed-size color histograms, only a
+ * row of scratch memory per thread is needed. The image is only replaced once
+ * quantization succeeds; on failure it's left unchanged.
  * The last argument defines the dithering algorithm to be used.
  *
  * C++: the dither argument is optional and defaults to IMG_DITHER_NONE
  */
 int img_quantize(struct img_pixmap *img, int maxcol, IMG_OPTARG(enum img_dither dither, IMG_DITHER_NONE));
+/* Sets the size of the Bayer matrix used by IMG_DITHER_ORDERED, which must be
+ * 2, 4, 8 (the default) or 16. Returns -1 for any other size.
+ */
+int img_set_dither_matrix(int size);
+/* Selects the algorithm img_quantize uses to pick the palette: IMG_QUANT_OCTREE
+ * (the default) or IMG_QUANT_MEDIAN_CUT. Either palette can then be improved
+ * with iter passes of k-means refinement, trading speed for quality (0, the
+ * default, for none; a handful of passes gets most of the benefit).
+ */
+int img_set_quantizer(enum img_quantizer method, int iter);
+
+/* Quantize an image to an existing palette, converting it to IMG_FMT_IDX8.
+ * The alpha of the palette is taken into account if the image has an alpha
+ * channel, and any palette color is translucent.
+ */
+int img_quantize_palette(struct img_pixmap *img, struct img_colormap *cmap,
+		IMG_OPTARG(enum img_dither dither, IMG_DITHER_NONE));
+
+/* Palette generator, for quantizing a set of images (like the frames of an
+ * animation) to a single palette. Add the images one at a time, then build the
+ * palette, and quantize each image to it with img_quantize_palette. The images
+ * don't need to be kept around in between. Uses the quantizer selected with
+ * img_set_quantizer at the time it's created. The palettes it builds are opaque,
+ * the alpha of the images is ignored.
+ */
+struct img_palgen;
+
+/* returns null if maxcol is not in [2, 256], or it runs out of memory */
+struct img_palgen *img_palgen_create(int maxcol);
+void img_palgen_free(struct img_palgen *pg);
+/* adds the colors of an image, which is left unchanged */
+int img_palgen_add(struct img_palgen *pg, struct img_pixmap *img);
+/* builds the palette from the colors added so far */
+int img_palgen_build(struct img_palgen *pg, struct img_colormap *cmap);
 
 /* Flip the image vertically or horizontally */
 void img_vflip(struct img_pixmap *img);
@@ -167,6 +317,9 @@ int img_to_float(struct img_pixmap *img);
 /* Converts an image from a floating point pixel format to the corresponding integer one */
 int img_to_integer(struct img_pixmap *img);
 
+/* Returns the size of a pixel in bytes, for the specified pixel format */
+int img_pixel_size(enum img_fmt fmt);
+
 /* Returns non-zero (true) if the supplied image is in a floating point pixel format */
 int img_is_float(struct img_pixmap *img);
 /* Returns non-zero (true) if the supplied image has an alpha channel */
@@ -19,6 +19,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 /* to avoid dependency to OpenGL, I'll define all the relevant GL macros manually */
 #define GL_UNPACK_ALIGNMENT		0x0cf5
+#define GL_UNPACK_ROW_LENGTH	0x0cf2
 
 #define GL_UNSIGNED_BYTE		0x1401
 #define GL_FLOAT				0x1406
@@ -200,7 +201,7 @@ unsigned int img_gltexture(struct img_pixmap *img)
 		struct img_pixmap rgb;
 
 		img_init(&rgb);
-		if(img_copy(&rgb, img) == -1 || img_convert(&rgb, IMG_FMT_RGB24)) {
+		if(img_view(&rgb, img, 0, 0, img->width, img->height) == -1 || img_convert(&rgb, IMG_FMT_RGB24)) {
 			return 0;
 		}
 		tex = img_gltexture(&rgb);
@@ -208,6 +209,19 @@ unsigned int img_gltexture(struct img_pixmap *img)
 		return tex;
 	}
 
+	if(img->pitch % img->pixelsz) {
+		/* GL can only skip whole pixels at the end of each row, use a packed copy */
+		struct img_pixmap packed;
+
+		img_init(&packed);
+		if(img_copy(&packed, img) == -1) {
+			return 0;
+		}
+		tex = img_gltexture(&packed);
+		img_destroy(&packed);
+		return tex;
+	}
+
 	intfmt = img_glintfmt(img);
 	fmt = img_glfmt(img);
 	type = img_gltype(img);
@@ -230,7 +244,9 @@ unsigned int img_gltexture(struct img_pixmap *img)
 			}
 		}
 	}
+	gl_pixel_storei(GL_UNPACK_ROW_LENGTH, img->pitch / img->pixelsz);
 	gl_tex_image2d(GL_TEXTURE_2D, 0, intfmt, img->width, img->height, 0, fmt, type, img->pixels);
+	gl_pixel_storei(GL_UNPACK_ROW_LENGTH, 0);
 	if(gl_generate_mipmap) {
 		gl_generate_mipmap(GL_TEXTURE_2D);
 	}
@@ -0,0 +1,537 @@
+/*
+libimago - a multi-format image file input/output library.
+Copyright (C) 2010-2026 John Tsiombikas <nuclear@mutantstargoat.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <string.h>
+#include <limits.h>
+#include <float.h>
+#include "palette.h"
+#include "alloc.h"
+#include "thrpool.h"
+#include "conv.h"
+
+#if defined(__SSE2__)
+#define PAL_SSE2
+#include <emmintrin.h>
+#elif defined(ENABLE_NEON) && defined(__aarch64__) && (defined(__ARM_NEON) || defined(__ARM_NEON__))
+#define PAL_NEON
+#include <arm_neon.h>
+#endif
+
+/* the histogram is built in bands of rows of at least this many pixels, each
+ * into its own set of bins, which are then added together
+ */
+#define HIST_MIN_PIXELS	(1 << 18)
+
+/* bin of the channel values c[0..3] (r, g, b, a), already shifted down to the
+ * bits of the histogram. Alpha goes in the top bits, and is always 0 in rgb
+ * histograms.
+ */
+#define BIN_INDEX(hist, c) \
+	((((((c)[3] << (hist)->bits) | (c)[0]) << (hist)->bits | (c)[1]) << (hist)->bits) | (c)[2])
+
+struct hist_job {
+	struct color_hist *hist;
+	struct img_pixmap *img;
+	enum img_fmt fmt;	/* the format the pixels are counted in */
+	unsigned char *rowbuf;	/* a row per band, if img isn't already in fmt */
+	struct color_bin **bins;	/* one set per band */
+};
+
+/* a box of bins for median cut, with the bin ranges inclusive on both ends */
+struct box {
+	int lo[4], hi[4];
+	long long count, sum[4];
+	double err;	/* sum of squared distances of its pixels from their mean */
+};
+
+static void count_band(void *cls, int band, int start, int end);
+static void box_stats(struct color_hist *hist, struct box *box);
+static void split_box(struct color_hist *hist, struct box *box, struct box *newbox);
+static int nearest(float **pal, int count, const float *col);
+
+
+int img_init_color_hist(struct color_hist *hist, int nchan)
+{
+	hist->nchan = nchan;
+	hist->bits = nchan == 4 ? CHIST_RGBA_BITS : CHIST_RGB_BITS;
+	hist->size = 1 << (nchan * hist->bits);
+
+	if(!(hist->bins = img_mem_alloc(hist->size * sizeof *hist->bins))) {
+		return -1;
+	}
+	memset(hist->bins, 0, hist->size * sizeof *hist->bins);
+	return 0;
+}
+
+void img_destroy_color_hist(struct color_hist *hist)
+{
+	img_mem_free(hist->bins);
+	hist->bins = 0;
+}
+
+int img_color_hist_add(struct color_hist *hist, struct img_pixmap *img)
+{
+	int i, j, nbands = 1;
+	struct hist_job job;
+	struct color_bin *bin;
+
+	if(img->width > 0) {
+		nbands = img_num_bands(img->height, HIST_MIN_PIXELS / img->width);
+	}
+
+	job.fmt = hist->nchan == 4 ? IMG_FMT_RGBA32 : IMG_FMT_RGB24;
+	job.rowbuf = 0;
+	if(img->fmt != job.fmt) {
+		if(!(job.rowbuf = img_mem_alloc((size_t)nbands * img->width * hist->nchan))) {
+			return -1;
+		}
+	}
+
+	/* the first band counts straight into the histogram, the rest into their own bins */
+	if(!(job.bins = img_mem_alloc(nbands * sizeof *job.bins))) {
+		img_mem_free(job.rowbuf);
+		return -1;
+	}
+	job.bins[0] = hist->bins;
+	for(i=1; i<nbands; i++) {
+		if(!(job.bins[i] = img_mem_alloc(hist->size * sizeof **job.bins))) {
+			while(--i > 0) {
+				img_mem_free(job.bins[i]);
+			}
+			img_mem_free(job.bins);
+			img_mem_free(job.rowbuf);
+			return -1;
+		}
+		memset(job.bins[i], 0, hist->size * sizeof **job.bins);
+	}
+	job.hist = hist;
+	job.img = img;
+
+	img_parallel_for(img->height, nbands, count_band, &job);
+
+	/* everything is integer, so the order we add them up in doesn't matter */
+	for(i=1; i<nbands; i++) {
+		bin = job.bins[i];
+		for(j=0; j<hist->size; j++) {
+			hist->bins[j].count += bin[j].count;
+			hist->bins[j].r += bin[j].r;
+			hist->bins[j].g += bin[j].g;
+			hist->bins[j].b += bin[j].b;
+			hist->bins[j].a += bin[j].a;
+			hist->bins[j].sqsum += bin[j].sqsum;
+		}
+		img_mem_free(bin);
+	}
+
+	img_mem_free(job.bins);
+	img_mem_free(job.rowbuf);
+	return 0;
+}
+
+/* counts the pixels of rows [start, end) into the bins of the band */
+static void count_band(void *cls, int band, int start, int end)
+{
+	int i, j, r, g, b, a, c[4];
+	struct hist_job *job = cls;
+	struct color_hist *hist = job->hist;
+	struct color_bin *bins = job->bins[band], *bin;
+	int nchan = hist->nchan, shift = 8 - hist->bits;
+	unsigned char *pix, *buf = 0;
+
+	if(job->rowbuf) {
+		buf = job->rowbuf + (size_t)band * job->img->width * nchan;
+	}
+
+	for(i=start; i<end; i++) {
+		pix = img_get_row(buf, job->fmt, job->img, i);
+		for(j=0; j<job->img->width; j++) {
+			r = pix[0];
+			g = pix[1];
+			b = pix[2];
+			a = 0;
+			if(nchan == 4 && !(a = pix[3])) {
+				r = g = b = 0;
+			}
+			pix += nchan;
+
+			c[0] = r >> shift;
+			c[1] = g >> shift;
+			c[2] = b >> shift;
+			c[3] = a >> shift;
+			bin = bins + BIN_INDEX(hist, c);
+			bin->count++;
+			bin->r += r;
+			bin->g += g;
+			bin->b += b;
+			bin->a += a;
+			bin->sqsum += r * r + g * g + b * b + a * a;
+		}
+	}
+}
+
+/* Heckbert's median cut: starting with a box around all the colors, keep
+ * splitting the box with the largest squared error at the median of its pixels,
+ * along its longest side, until we have maxcol boxes, or run out of boxes
+ * with more than one bin.
+ */
+int img_median_cut(struct color_hist *hist, int maxcol, struct img_colormap *cmap)
+{
+	int i, sel, nboxes;
+	struct box *boxes, *box;
+
+	if(!(boxes = img_mem_alloc(maxcol * sizeof *boxes))) {
+		return -1;
+	}
+
+	for(i=0; i<4; i++) {
+		boxes[0].lo[i] = 0;
+		boxes[0].hi[i] = i < hist->nchan ? (1 << hist->bits) - 1 : 0;
+	}
+	box_stats(hist, boxes);
+	nboxes = boxes[0].count > 0 ? 1 : 0;
+
+	while(nboxes > 0 && nboxes < maxcol) {
+		sel = -1;
+		for(i=0; i<nboxes; i++) {
+			box = boxes + i;
+			if(box->lo[0] == box->hi[0] && box->lo[1] == box->hi[1] && box->lo[2] == box->hi[2] &&
+					box->lo[3] == box->hi[3]) {
+				continue;	/* single bin, can't split it */
+			}
+			if(sel == -1 || box->err > boxes[sel].err) {
+				sel = i;
+			}
+		}
+		if(sel == -1) break;
+
+		split_box(hist, boxes + sel, boxes + nboxes++);
+	}
+
+	for(i=0; i<nboxes; i++) {
+		box = boxes + i;
+		cmap->color[i].r = (box->sum[0] + box->count / 2) / box->count;
+		cmap->color[i].g = (box->sum[1] + box->count / 2) / box->count;
+		cmap->color[i].b = (box->sum[2] + box->count / 2) / box->count;
+		cmap->alpha[i] = hist->nchan == 4 ? (box->sum[3] + box->count / 2) / box->count : 255;
+	}
+	cmap->ncolors = nboxes;
+
+	img_mem_free(boxes);
+	return 0;
+}
+
+/* shrinks the box to the bins with pixels in them, and computes its stats */
+static void box_stats(struct color_hist *hist, struct box *box)
+{
+	int i, c[4], lo[4], hi[4];
+	long long sqsum = 0;
+	struct color_bin *bin;
+
+	box->count = 0;
+	for(i=0; i<4; i++) {
+		box->sum[i] = 0;
+		lo[i] = INT_MAX;
+		hi[i] = -1;
+	}
+
+	for(c[3]=box->lo[3]; c[3]<=box->hi[3]; c[3]++) {
+		for(c[0]=box->lo[0]; c[0]<=box->hi[0]; c[0]++) {
+			for(c[1]=box->lo[1]; c[1]<=box->hi[1]; c[1]++) {
+				c[2] = box->lo[2];
+				bin = hist->bins + BIN_INDEX(hist, c);
+				for(; c[2]<=box->hi[2]; c[2]++) {
+					if(bin->count) {
+						box->count += bin->count;
+						box->sum[0] += bin->r;
+						box->sum[1] += bin->g;
+						box->sum[2] += bin->b;
+						box->sum[3] += bin->a;
+						sqsum += bin->sqsum;
+
+						for(i=0; i<4; i++) {
+							if(c[i] < lo[i]) lo[i] = c[i];
+							if(c[i] > hi[i]) hi[i] = c[i];
+						}
+					}
+					bin++;
+				}
+			}
+		}
+	}
+
+	if(box->count) {
+		box->err = (double)sqsum;
+		for(i=0; i<4; i++) {
+			box->lo[i] = lo[i];
+			box->hi[i] = hi[i];
+			box->err -= (double)box->sum[i] * box->sum[i] / (double)box->count;
+		}
+	} else {
+		box->err = 0.0;
+	}
+}
+
+/* splits a box in two at the median of its pixels along its longest side. The
+ * box is shrunk to its pixels, so both halves end up with some.
+ */
+static void split_box(struct color_hist *hist, struct box *box, struct box *newbox)
+{
+	int i, axis, p, c[4];
+	long long acc, half, plane[1 << CHIST_RGB_BITS] = {0};
+
+	axis = 0;
+	for(i=1; i<4; i++) {
+		if(box->hi[i] - box->lo[i] > box->hi[axis] - box->lo[axis]) {
+			axis = i;
+		}
+	}
+
+	for(c[3]=box->lo[3]; c[3]<=box->hi[3]; c[3]++) {
+		for(c[0]=box->lo[0]; c[0]<=box->hi[0]; c[0]++) {
+			for(c[1]=box->lo[1]; c[1]<=box->hi[1]; c[1]++) {
+				for(c[2]=box->lo[2]; c[2]<=box->hi[2]; c[2]++) {
+					plane[c[axis]] += hist->bins[BIN_INDEX(hist, c)].count;
+				}
+			}
+		}
+	}
+
+	half = box->count / 2;
+	acc = 0;
+	for(p=box->lo[axis]; p<box->hi[axis] - 1; p++) {
+		if((acc += plane[p]) >= half) break;
+	}
+
+	*newbox = *box;
+	box->hi[axis] = p;
+	newbox->lo[axis] = p + 1;
+	box_stats(hist, box);
+	box_stats(hist, newbox);
+}
+
+/* Lloyd's k-means over the non-empty bins of the histogram, each one standing
+ * for its pixels at their mean color, starting from the current palette. The
+ * nearest palette color search for each bin is done 4 colors at a time with
+ * SIMD where available. Palette colors nobody is closest to are left alone.
+ * In rgb histograms, alpha is 0 in both the bins and the palette, and doesn't
+ * affect the distances.
+ */
+int img_refine_palette(struct color_hist *hist, struct img_colormap *cmap, int iter)
+{
+	int i, j, k, nsamples, npal, changed;
+	int *samples;
+	float *fsamp, *pal[4];
+	long long (*sums)[5];
+	struct color_bin *bin;
+	unsigned char col[4];
+
+	if(cmap->ncolors <= 1 || iter <= 0) {
+		return 0;
+	}
+
+	/* round the palette up to a whole number of vectors, with the padding far
+	 * away from any color
+	 */
+	npal = (cmap->ncolors + 3) & ~3;
+
+	samples = img_mem_alloc(hist->size * sizeof *samples);
+	fsamp = img_mem_alloc(hist->size * 4 * sizeof *fsamp);
+	pal[0] = img_mem_alloc(npal * 4 * sizeof *pal[0]);
+	sums = img_mem_alloc(cmap->ncolors * sizeof *sums);
+	if(!samples || !fsamp || !pal[0] || !sums) {
+		img_mem_free(samples);
+		img_mem_free(fsamp);
+		img_mem_free(pal[0]);
+		img_mem_free(sums);
+		return -1;
+	}
+	for(i=1; i<4; i++) {
+		pal[i] = pal[i - 1] + npal;
+	}
+
+	nsamples = 0;
+	for(i=0; i<hist->size; i++) {
+		bin = hist->bins + i;
+		if(bin->count) {
+			fsamp[nsamples * 4] = (float)bin->r / (float)bin->count;
+			fsamp[nsamples * 4 + 1] = (float)bin->g / (float)bin->count;
+			fsamp[nsamples * 4 + 2] = (float)bin->b / (float)bin->count;
+			fsamp[nsamples * 4 + 3] = (float)bin->a / (float)bin->count;
+			samples[nsamples++] = i;
+		}
+	}
+
+	for(i=0; i<npal; i++) {
+		pal[0][i] = i < cmap->ncolors ? cmap->color[i].r : 1e6f;
+		pal[1][i] = i < cmap->ncolors ? cmap->color[i].g : 1e6f;
+		pal[2][i] = i < cmap->ncolors ? cmap->color[i].b : 1e6f;
+		pal[3][i] = i < cmap->ncolors && hist->nchan == 4 ? cmap->alpha[i] : 0.0f;
+	}
+
+	for(i=0; i<iter; i++) {
+		memset(sums, 0, cmap->ncolors * sizeof *sums);
+
+		for(j=0; j<nsamples; j++) {
+			k = nearest(pal, npal, fsamp + j * 4);
+			bin = hist->bins + samples[j];
+			sums[k][0] += bin->r;
+			sums[k][1] += bin->g;
+			sums[k][2] += bin->b;
+			sums[k][3] += bin->a;
+			sums[k][4] += bin->count;
+		}
+
+		changed = 0;
+		for(k=0; k<cmap->ncolors; k++) {
+			if(!sums[k][4]) continue;
+
+			for(j=0; j<4; j++) {
+				col[j] = (sums[k][j] + sums[k][4] / 2) / sums[k][4];
+			}
+			if(hist->nchan < 4) col[3] = 255;
+
+			if(col[0] != cmap->color[k].r || col[1] != cmap->color[k].g || col[2] != cmap->color[k].b ||
+					col[3] != cmap->alpha[k]) {
+				cmap->color[k].r = col[0];
+				cmap->color[k].g = col[1];
+				cmap->color[k].b = col[2];
+				cmap->alpha[k] = col[3];
+				for(j=0; j<hist->nchan; j++) {
+					pal[j][k] = col[j];
+				}
+				changed = 1;
+			}
+		}
+		if(!changed) break;
+	}
+
+	img_mem_free(samples);
+	img_mem_free(fsamp);
+	img_mem_free(pal[0]);
+	img_mem_free(sums);
+	return 0;
+}
+
+/* returns the index of the palette color nearest to col (r, g, b, a), the
+ * lowest one in case of a tie. count is a multiple of 4.
+ */
+#ifdef PAL_SSE2
+static int nearest(float **pal, int count, const float *col)
+{
+	int i, best_idx, idx[4];
+	float best, dist[4];
+	__m128 d, dr, dg, db, da, vbest;
+	__m128i lt, vidx, vbest_idx, four;
+	__m128 vr = _mm_set1_ps(col[0]), vg = _mm_set1_ps(col[1]);
+	__m128 vb = _mm_set1_ps(col[2]), va = _mm_set1_ps(col[3]);
+
+	vbest = _mm_set1_ps(FLT_MAX);
+	vidx = _mm_setr_epi32(0, 1, 2, 3);
+	vbest_idx = _mm_setzero_si128();
+	four = _mm_set1_epi32(4);
+
+	for(i=0; i<count; i+=4) {
+		dr = _mm_sub_ps(_mm_loadu_ps(pal[0] + i), vr);
+		dg = _mm_sub_ps(_mm_loadu_ps(pal[1] + i), vg);
+		db = _mm_sub_ps(_mm_loadu_ps(pal[2] + i), vb);
+		da = _mm_sub_ps(_mm_loadu_ps(pal[3] + i), va);
+		d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dr, dr), _mm_mul_ps(dg, dg)),
+				_mm_add_ps(_mm_mul_ps(db, db), _mm_mul_ps(da, da)));
+
+		lt = _mm_castps_si128(_mm_cmplt_ps(d, vbest));
+		vbest = _mm_min_ps(d, vbest);
+		vbest_idx = _mm_or_si128(_mm_and_si128(lt, vidx), _mm_andnot_si128(lt, vbest_idx));
+		vidx = _mm_add_epi32(vidx, four);
+	}
+	_mm_storeu_ps(dist, vbest);
+	_mm_storeu_si128((__m128i*)idx, vbest_idx);
+
+	best = dist[0];
+	best_idx = idx[0];
+	for(i=1; i<4; i++) {
+		if(dist[i] < best || (dist[i] == best && idx[i] < best_idx)) {
+			best = dist[i];
+			best_idx = idx[i];
+		}
+	}
+	return best_idx;
+}
+
+#elif defined(PAL_NEON)
+static int nearest(float **pal, int count, const float *col)
+{
+	static const int32_t first_idx[] = {0, 1, 2, 3};
+	int i, best_idx, idx[4];
+	float best, dist[4];
+	float32x4_t d, dr, dg, db, da, vbest;
+	uint32x4_t lt;
+	int32x4_t vidx, vbest_idx, four;
+	float32x4_t vr = vdupq_n_f32(col[0]), vg = vdupq_n_f32(col[1]);
+	float32x4_t vb = vdupq_n_f32(col[2]), va = vdupq_n_f32(col[3]);
+
+	vbest = vdupq_n_f32(FLT_MAX);
+	vidx = vld1q_s32(first_idx);
+	vbest_idx = vdupq_n_s32(0);
+	four = vdupq_n_s32(4);
+
+	for(i=0; i<count; i+=4) {
+		dr = vsubq_f32(vld1q_f32(pal[0] + i), vr);
+		dg = vsubq_f32(vld1q_f32(pal[1] + i), vg);
+		db = vsubq_f32(vld1q_f32(pal[2] + i), vb);
+		da = vsubq_f32(vld1q_f32(pal[3] + i), va);
+		d = vaddq_f32(vaddq_f32(vmulq_f32(dr, dr), vmulq_f32(dg, dg)),
+				vaddq_f32(vmulq_f32(db, db), vmulq_f32(da, da)));
+
+		lt = vcltq_f32(d, vbest);
+		vbest = vbslq_f32(lt, d, vbest);
+		vbest_idx = vbslq_s32(lt, vidx, vbest_idx);
+		vidx = vaddq_s32(vidx, four);
+	}
+	vst1q_f32(dist, vbest);
+	vst1q_s32(idx, vbest_idx);
+
+	best = dist[0];
+	best_idx = idx[0];
+	for(i=1; i<4; i++) {
+		if(dist[i] < best || (dist[i] == best && idx[i] < best_idx)) {
+			best = dist[i];
+			best_idx = idx[i];
+		}
+	}
+	return best_idx;
+}
+
+#else
+static int nearest(float **pal, int count, const float *col)
+{
+	int i, best_idx = 0;
+	float d, dr, dg, db, da, best = FLT_MAX;
+
+	for(i=0; i<count; i++) {
+		dr = pal[0][i] - col[0];
+		dg = pal[1][i] - col[1];
+		db = pal[2][i] - col[2];
+		da = pal[3][i] - col[3];
+		d = dr * dr + dg * dg + db * db + da * da;
+		if(d < best) {
+			best = d;
+			best_idx = i;
+		}
+	}
+	return best_idx;
+}
+#endif
@@ -0,0 +1,63 @@
+/*
+libimago - a multi-format image file input/output library.
+Copyright (C) 2010-2026 John Tsiombikas <nuclear@mutantstargoat.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef IMAGO_PALETTE_H_
+#define IMAGO_PALETTE_H_
+
+#include "imago2.h"
+
+/* Palette construction by median cut, and k-means palette refinement, used by
+ * img_quantize as alternatives to, or on top of, the octree quantizer.
+ * Both work on a histogram of the image, which keeps the exact color sums of
+ * the pixels in each bin: 32x32x32 bins for rgb24 images, and 16x16x16x16 for
+ * rgba32 images, which are quantized with alpha as a fourth channel.
+ */
+#define CHIST_RGB_BITS	5
+#define CHIST_RGBA_BITS	4
+
+struct color_bin {
+	long long count;
+	long long r, g, b, a;
+	long long sqsum;	/* sum of r^2 + g^2 + b^2 + a^2 */
+};
+
+struct color_hist {
+	struct color_bin *bins;
+	int nchan;	/* 3 for rgb24 pixels, 4 for rgba32 */
+	int bits;	/* bits of each channel in the bin index */
+	int size;	/* number of bins */
+};
+
+/* creates an empty histogram for rgb24 (nchan 3) or rgba32 (nchan 4) pixels.
+ * Returns -1 if it runs out of memory
+ */
+int img_init_color_hist(struct color_hist *hist, int nchan);
+void img_destroy_color_hist(struct color_hist *hist);
+/* adds the pixels of an image, read as rgb24 or rgba32 to match the histogram,
+ * without modifying it. Fully transparent pixels are all counted as
+ * transparent black.
+ */
+int img_color_hist_add(struct color_hist *hist, struct img_pixmap *img);
+
+/* creates a palette of at most maxcol colors by median cut. Returns -1 on failure */
+int img_median_cut(struct color_hist *hist, int maxcol, struct img_colormap *cmap);
+
+/* improves the palette in cmap with iter passes of k-means clustering */
+int img_refine_palette(struct color_hist *hist, struct img_colormap *cmap, int iter);
+
+#endif	/* IMAGO_PALETTE_H_ */
@@ -22,157 +22,495 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <errno.h>
 #include <assert.h>
 #include "imago2.h"
+#include "alloc.h"
+#include "thrpool.h"
+#include "palette.h"
+#include "conv.h"
+
+#if defined(__SSE2__)
+#define DITHER_SSE2
+#include <emmintrin.h>
+#elif defined(ENABLE_NEON) && defined(__aarch64__) && (defined(__ARM_NEON) || defined(__ARM_NEON__))
+#define DITHER_NEON
+#include <arm_neon.h>
+#endif
 
 #define NUM_LEVELS	8
+#define SLAB_NODES	256
 
 struct octnode;
+struct node_slab;
+
+/* Min-heap of the reducible nodes of one level, by nref. The heap order goes
+ * by the nref each node had when it was last sifted (heapkey), and because nref
+ * only ever grows, the top of the heap is only taken after checking that its
+ * key is current; if not, it's updated and sifted down, and we look again.
+ * Ties go to the most recently added node (highest seq).
+ */
+struct node_heap {
+	struct octnode **nodes;
+	int count, size;
+};
 
 struct octree {
 	struct octnode *root;
-	struct octnode *redlist[NUM_LEVELS];
+	struct node_heap redheap[NUM_LEVELS];
 	int redlev;
 	int nleaves, maxcol;
+	unsigned int seq;
+
+	/* node pool: nodes are carved out of slabs, and recycled through freelist */
+	struct node_slab *slabs;
+	int slab_used;	/* nodes handed out from the first slab */
+	struct octnode *freelist;
 };
 
 struct octnode {
 	int lvl;
 	struct octree *tree;
-	int r, g, b, nref;
+	long long r, g, b, nref;	/* color sums and pixel count, can exceed 2^31 */
 	int palidx;
 	int nsub, leaf;
 	struct octnode *sub[8];
-	struct octnode *next;
+	struct octnode *next;	/* next in the freelist */
+
+	long long heapkey;
+	int heapidx;	/* index in the reducible node heap of its level, or -1 */
+	unsigned int seq;
+};
+
+struct node_slab {
+	struct octnode nodes[SLAB_NODES];
+	struct node_slab *next;
+};
+
+/* Histogram of the distinct colors of an image, so that each one is added to
+ * the octree once, with its pixel count, instead of once per pixel. The colors
+ * are kept in order of appearance, and found through an open addressing hash
+ * table of indices. When it fills up, it's flushed into the octree and
+ * cleared, to bound its size on images with lots of colors. If by then it
+ * hasn't merged enough pixels to pay for the hashing, it's not used any more,
+ * and the rest of the pixels go straight into the octree.
+ */
+#define HIST_MAX_COLORS	(1 << 14)
+
+/* The histogram pass goes over the image in chunks of rows of about this many
+ * pixels, counted on multiple threads, each into its own histogram. The
+ * histograms are then flushed into the octree serially, in chunk order, and
+ * since the chunks only depend on the size of the image, so does the palette,
+ * regardless of the number of threads.
+ */
+#define HIST_CHUNK_PIXELS	(1 << 20)
+
+/* the non-dithered mapping pass is split into bands of rows of at least this
+ * many pixels, each one with its own inverse colormap
+ */
+#define MAP_MIN_PIXELS	(1 << 18)
+
+/* Ordered dithering offsets, added to the color channels of a pixel before
+ * mapping it to the palette (alpha is left alone). Each row of the Bayer matrix
+ * is repeated to 16 pixels, and split into its positive and negative offsets,
+ * so that they can be applied 16 bytes at a time with saturating arithmetic.
+ */
+#define DITHER_MAX_SIZE	16
+#define DITHER_MAX_ROW	(DITHER_MAX_SIZE * 4)
+
+struct dither_pattern {
+	int size;
+	int row_size;	/* bytes in a row: 16 pixels of 3 or 4 channels */
+	unsigned char pos[DITHER_MAX_SIZE][DITHER_MAX_ROW];
+	unsigned char neg[DITHER_MAX_SIZE][DITHER_MAX_ROW];
+};
+
+static int dither_size = 8;
+
+static enum img_quantizer quant_method = IMG_QUANT_OCTREE;
+static int quant_iter;
+
+/* Floyd-Steinberg error diffusion keeps the error pushed down to the next row
+ * in rows of its own, in 1/16ths so that it's distributed exactly, and leaves
+ * the source pixels alone. Rows are dithered as a wavefront on multiple
+ * threads, each one following the row above by a couple of pixels, and rotate
+ * through one more error row than there are threads: each one reads its own,
+ * and writes the next.
+ */
+#define FS_STEP		256
+
+struct fs_job {
+	struct img_pixmap *dest, *src;
+	int nchan;	/* 3 to dither in rgb24, 4 in rgba32 */
+	enum img_fmt fmt;
+	struct img_colormap *cmap;
+	struct inv_colormap *inv;	/* one per worker */
+	unsigned char *rowbuf;	/* a row per worker, if src isn't already in fmt */
+	int *status;	/* per worker, 0 or -1 if it ran out of memory */
+	short *err;
+	int num_err_rows, err_pitch;
+};
+
+/* Inverse colormap, for mapping pixels to their nearest palette color. The
+ * RGB cube is split into cells, and the first time a cell is needed we find
+ * which palette colors can be nearest to any point in it. Most cells end up
+ * with a single candidate, which is stored directly in the table. The rest
+ * get a short list of candidates, sorted by their distance from the cell,
+ * which is searched for the exact nearest color of each pixel.
+ * Cells are built coarse to fine, each one from the candidates of its parent,
+ * to keep the cost of filling the table low.
+ */
+#define LUT_LEVELS	3
+static const int lut_bits[LUT_LEVELS] = {2, 4, 5};
+
+#define LUT_CELL(bits, r, g, b)	\
+	((((r) >> (8 - (bits))) << (2 * (bits))) | (((g) >> (8 - (bits))) << (bits)) | ((b) >> (8 - (bits))))
+
+/* cell table entries */
+#define CELL_EMPTY		-1
+#define CELL_LIST(offs)	(256 + (offs))	/* >= 256: offset of the candidate list */
+
+struct candidate {
+	int idx;
+	int dist;	/* distance of the nearest point of the cell, or list size */
+};
+
+struct inv_colormap {
+	int nchan;
+	int *cell[LUT_LEVELS];
+	int root;
+	struct candidate *cand;	/* candidate lists, count followed by the candidates */
+	int cand_size, cand_max;
+	struct img_colormap *cmap;
+	int last_rgb, last_idx;
+	struct rgba_cache *cache;	/* for rgba pixels, instead of the cells */
+};
+
+/* RGBA pixels are matched against the whole palette instead, and the results
+ * are kept in a direct-mapped cache, since images with alpha (icons, UI assets)
+ * tend to have few distinct colors.
+ */
+#define RGBA_CACHE_BITS	12
+
+struct rgba_cache {
+	unsigned int rgba;
+	int idx;	/* -1 for empty entries */
+};
+
+struct hist_entry {
+	unsigned int rgb;
+	int count;
+};
+
+struct histogram {
+	struct hist_entry *colors;
+	int *slots;	/* indices into colors, -1 for empty slots */
+	int count, max_colors;
+	unsigned int slot_mask;
+	int hash_shift;
+};
+
+struct hist_chunk {
+	struct histogram hist;
+	int row, col;	/* where counting stopped, if the histogram filled up */
+	int end;
+	unsigned char *rowbuf;	/* for converting rows to rgb24, null if already rgb24 */
+};
+
+struct hist_job {
+	struct img_pixmap *img;
+	struct hist_chunk *chunks;
+	int first_row, chunk_rows;
+};
+
+struct map_job {
+	struct img_pixmap *dest, *src;
+	int nchan;
+	enum img_fmt fmt;
+	struct img_colormap *cmap;
+	struct dither_pattern *dither;	/* null for no dithering */
+	int *status;	/* per band, 0 or -1 if it ran out of memory */
+};
+
+/* palette generator, collecting the colors of any number of images. The
+ * quantizer settings are captured when it's created.
+ */
+struct img_palgen {
+	int maxcol, iter;
+	int nchan;	/* 3 for rgb24 images, 4 for rgba32, which always use median cut */
+	enum img_quantizer method;
+	struct octree tree;	/* for IMG_QUANT_OCTREE */
+	struct color_hist hist;	/* for IMG_QUANT_MEDIAN_CUT, or k-means refinement */
 };
 
 
+static int init_palgen(struct img_palgen *pg, int maxcol, int nchan);
+static void destroy_palgen(struct img_palgen *pg);
+static int add_colors(struct img_palgen *pg, struct img_pixmap *img);
+static int remap(struct img_pixmap *img, struct img_colormap *cmap, enum img_dither dither,
+		int nchan);
+static int has_alpha(struct img_pixmap *img);
+
 static int init_octree(struct octree *tree, int maxcol);
 static void destroy_octree(struct octree *tree);
 
 static struct octnode *alloc_node(struct octree *tree, int lvl);
 static void free_node(struct octnode *n);
-static void free_tree(struct octnode *n);
+
+static int heap_insert(struct node_heap *heap, struct octnode *n);
+static void heap_remove(struct node_heap *heap, struct octnode *n);
+static void heap_sift_down(struct node_heap *heap, int idx);
+static void heap_sift_up(struct node_heap *heap, int idx);
+
+static int init_histogram(struct histogram *hist, size_t npix);
+static void destroy_histogram(struct histogram *hist);
+static struct hist_entry *hist_add(struct histogram *hist, unsigned int rgb);
+static int flush_histogram(struct histogram *hist, struct octree *tree);
+static void insert_color(struct octree *tree, unsigned int rgb, int count);
+static int build_octree(struct octree *tree, struct img_pixmap *img);
+static void count_chunk(void *cls, int band, int start, int end);
+static void count_colors(struct histogram *hist, struct img_pixmap *img, unsigned char *buf,
+		int *row, int *col, int end);
+static void finish_chunk(struct octree *tree, struct img_pixmap *img, struct hist_chunk *chunk);
 
 static void add_color(struct octree *tree, int r, int g, int b, int nref);
 static void reduce_colors(struct octree *tree);
 static int assign_colors(struct octnode *n, int next, struct img_colormap *cmap);
-static int lookup_color(struct octree *tree, int r, int g, int b);
+static int init_inv_colormap(struct inv_colormap *inv, struct img_colormap *cmap, int nchan);
+static void destroy_inv_colormap(struct inv_colormap *inv);
+static int map_pixel(struct inv_colormap *inv, unsigned char *pix);
+static int map_color(struct inv_colormap *inv, int r, int g, int b);
+static int map_color_rgba(struct inv_colormap *inv, unsigned char *pix);
+static int get_cell(struct inv_colormap *inv, int lvl, int r, int g, int b);
+static int build_cell(struct inv_colormap *inv, int lvl, int cell, int parent);
+static struct candidate *alloc_candidates(struct inv_colormap *inv, int count, int *offs);
+static int map_pixels(struct img_pixmap *dest, struct img_pixmap *src, int nchan,
+		struct img_colormap *cmap, struct dither_pattern *dither);
+static void map_band(void *cls, int band, int start, int end);
+static int dither_fs(struct img_pixmap *dest, struct img_pixmap *src, int nchan,
+		struct img_colormap *cmap);
+static void dither_fs_step(void *cls, int worker, int row, int start, int end);
+static void init_dither_pattern(struct dither_pattern *pat, int size, struct img_colormap *cmap,
+		int nchan);
+static void add_dither(unsigned char *dest, unsigned char *src, unsigned char *pos,
+		unsigned char *neg, int row_size, int nbytes);
 static int subidx(int bit, int r, int g, int b);
 /*static void print_tree(struct octnode *n, int lvl);*/
 
 #define CLAMP(x, a, b)	((x) < (a) ? (a) : ((x) > (b) ? (b) : (x)))
-static void add_error(unsigned char *dest, int *err, int s, int *acc)
-{
-	int r, g, b;
-	if(s) {
-		r = s * err[0] >> 4;
-		g = s * err[1] >> 4;
-		b = s * err[2] >> 4;
-		acc[0] += r;
-		acc[1] += g;
-		acc[2] += b;
-	} else {
-		r = err[0];
-		g = err[1];
-		b = err[2];
-	}
-	r += dest[0];
-	g += dest[1];
-	b += dest[2];
-	dest[0] = CLAMP(r, 0, 255);
-	dest[1] = CLAMP(g, 0, 255);
-	dest[2] = CLAMP(b, 0, 255);
-}
 
 int img_quantize(struct img_pixmap *img, int maxcol, enum img_dither dither)
 {
-	int i, j, cidx, rgbpitch;
-	struct octree tree;
-	struct img_pixmap newimg;
-	struct img_colormap *cmap;
-	unsigned char *dest, *rgb;
-	int err[3], acc[3];
+	int nchan;
+	struct img_palgen pg;
+	struct img_colormap cmap;
 
 	if(maxcol < 2 || maxcol > 256) {
 		return -1;
 	}
 
-	img_init(&newimg);
-	if(img_set_pixels(&newimg, img->width, img->height, IMG_FMT_IDX8, 0) == -1) {
+	/* The pixels are read as rgb24, or rgba32 if the image has alpha. Images
+	 * in other formats are converted a row at a time as they're read, by each
+	 * pass, and the image is only replaced once the quantized one is complete.
+	 */
+	nchan = has_alpha(img) ? 4 : 3;
+
+	if(init_palgen(&pg, maxcol, nchan) == -1) {
 		return -1;
 	}
-	cmap = img_colormap(&newimg);
-
-	/* convert the source image to rgb24 to work with the pixels directly */
-	if(img_convert(img, IMG_FMT_RGB24) == -1) {
-		img_destroy(&newimg);
+	if(add_colors(&pg, img) == -1 || img_palgen_build(&pg, &cmap) == -1) {
+		destroy_palgen(&pg);
 		return -1;
 	}
-	rgbpitch = img->width * 3;
+	destroy_palgen(&pg);
 
-	if(init_octree(&tree, maxcol) == -1) {
+	return remap(img, &cmap, dither, nchan);
+}
+
+int img_quantize_palette(struct img_pixmap *img, struct img_colormap *cmap, enum img_dither dither)
+{
+	int i, translucent = 0;
+
+	if(cmap->ncolors < 1 || cmap->ncolors > 256) {
 		return -1;
 	}
 
-	rgb = img->pixels;
-	for(i=0; i<img->height; i++) {
-		for(j=0; j<img->width; j++) {
-			add_color(&tree, rgb[0], rgb[1], rgb[2], 1);
-			rgb += 3;
-
-			while(tree.nleaves > maxcol) {
-				reduce_colors(&tree);
-			}
-		}
+	/* alpha only matters if both the image and the palette have it */
+	for(i=0; i<cmap->ncolors; i++) {
+		if(cmap->alpha[i] < 255) translucent = 1;
 	}
+	return remap(img, cmap, dither, translucent && has_alpha(img) ? 4 : 3);
+}
 
-	/* use created octree to generate the palette */
-	cmap->ncolors = assign_colors(tree.root, 0, cmap);
+struct img_palgen *img_palgen_create(int maxcol)
+{
+	struct img_palgen *pg;
 
-	/* replace image pixels */
-	dest = newimg.pixels;
-	rgb = img->pixels;
-	for(i=0; i<img->height; i++) {
-		for(j=0; j<img->width; j++) {
-			cidx = lookup_color(&tree, rgb[0], rgb[1], rgb[2]);
-			assert(cidx >= 0 && cidx < maxcol);
-			*dest++ = cidx;
+	if(maxcol < 2 || maxcol > 256) {
+		return 0;
+	}
+	if(!(pg = img_mem_alloc(sizeof *pg))) {
+		return 0;
+	}
+	if(init_palgen(pg, maxcol, 3) == -1) {
+		img_mem_free(pg);
+		return 0;
+	}
+	return pg;
+}
 
-			switch(dither) {
-			case IMG_DITHER_FLOYD_STEINBERG:
-				err[0] = (int)rgb[0] - (int)cmap->color[cidx].r;
-				err[1] = (int)rgb[1] - (int)cmap->color[cidx].g;
-				err[2] = (int)rgb[2] - (int)cmap->color[cidx].b;
-				acc[0] = acc[1] = acc[2] = 0;
-				if(j < img->width - 1) {
-					add_error(rgb + 3, err, 7, acc);
-				}
-				if(i < img->height - 1) {
-					if(j > 0) {
-						add_error(rgb + rgbpitch - 3, err, 3, acc);
-					}
-					add_error(rgb + rgbpitch, err, 5, acc);
-					if(j < img->width - 1) {
-						err[0] -= acc[0];
-						err[1] -= acc[1];
-						err[2] -= acc[2];
-						add_error(rgb + rgbpitch + 3, err, 0, 0);
-					}
-				}
-				break;
-			default:
-				break;
-			}
+void img_palgen_free(struct img_palgen *pg)
+{
+	if(pg) {
+		destroy_palgen(pg);
+		img_mem_free(pg);
+	}
+}
 
-			rgb += 3;
+int img_palgen_add(struct img_palgen *pg, struct img_pixmap *img)
+{
+	return add_colors(pg, img);
+}
+
+int img_palgen_build(struct img_palgen *pg, struct img_colormap *cmap)
+{
+	if(pg->method == IMG_QUANT_OCTREE) {
+		/* use created octree to generate the palette */
+		cmap->ncolors = assign_colors(pg->tree.root, 0, cmap);
+	} else {
+		if(img_median_cut(&pg->hist, pg->maxcol, cmap) == -1) {
+			return -1;
 		}
 	}
+	if(pg->iter > 0) {
+		return img_refine_palette(&pg->hist, cmap, pg->iter);
+	}
+	return 0;
+}
+
+/* replaces img with an IDX8 image mapped to cmap, matching its pixels as rgb24
+ * (nchan 3) or rgba32 (nchan 4). img is left alone if it fails.
+ */
+static int remap(struct img_pixmap *img, struct img_colormap *cmap, enum img_dither dither,
+		int nchan)
+{
+	int res;
+	struct img_pixmap newimg;
+	struct img_colormap *newcmap;
+	struct dither_pattern dpat;
+
+	img_init(&newimg);
+	if(img_set_pixels(&newimg, img->width, img->height, IMG_FMT_IDX8, 0) == -1) {
+		return -1;
+	}
+	/* only the used entries, the rest stay black and opaque from img_set_pixels */
+	newcmap = img_colormap(&newimg);
+	newcmap->ncolors = cmap->ncolors;
+	memcpy(newcmap->color, cmap->color, cmap->ncolors * sizeof *cmap->color);
+	memcpy(newcmap->alpha, cmap->alpha, cmap->ncolors);
+	cmap = newcmap;
+
+	/* replace image pixels */
+	switch(dither) {
+	case IMG_DITHER_FLOYD_STEINBERG:
+		res = dither_fs(&newimg, img, nchan, cmap);
+		break;
+
+	case IMG_DITHER_ORDERED:
+		init_dither_pattern(&dpat, dither_size, cmap, nchan);
+		res = map_pixels(&newimg, img, nchan, cmap, &dpat);
+		break;
+
+	default:
+		res = map_pixels(&newimg, img, nchan, cmap, 0);
+	}
+	if(res == -1) {
+		img_destroy(&newimg);
+		return -1;
+	}
 
 	newimg.name = img->name;
 	img->name = 0;
 	img_destroy(img);
 	*img = newimg;
+	return 0;
+}
 
-	destroy_octree(&tree);
+int img_set_dither_matrix(int size)
+{
+	if(size < 2 || size > DITHER_MAX_SIZE || (size & (size - 1))) {
+		return -1;
+	}
+	dither_size = size;
+	return 0;
+}
+
+int img_set_quantizer(enum img_quantizer method, int iter)
+{
+	if((method != IMG_QUANT_OCTREE && method != IMG_QUANT_MEDIAN_CUT) || iter < 0) {
+		return -1;
+	}
+	quant_method = method;
+	quant_iter = iter;
+	return 0;
+}
+
+/* Returns non-zero if the image has an alpha channel, or translucent colors in
+ * its palette. Unlike img_has_alpha, this includes IMG_FMT_BGRA32 and IDX8.
+ */
+static int has_alpha(struct img_pixmap *img)
+{
+	int i;
+	struct img_colormap *cmap;
+
+	if(img->fmt == IMG_FMT_RGBA32 || img->fmt == IMG_FMT_RGBAF || img->fmt == IMG_FMT_BGRA32) {
+		return 1;
+	}
+	if((cmap = img_colormap(img))) {
+		for(i=0; i<cmap->ncolors; i++) {
+			if(cmap->alpha[i] < 255) return 1;
+		}
+	}
+	return 0;
+}
+
+/* the octree only handles rgb, so rgba (nchan 4) palettes always use median cut */
+static int init_palgen(struct img_palgen *pg, int maxcol, int nchan)
+{
+	pg->maxcol = maxcol;
+	pg->nchan = nchan;
+	pg->method = nchan == 4 ? IMG_QUANT_MEDIAN_CUT : quant_method;
+	pg->iter = quant_iter;
+	pg->tree.root = 0;
+	pg->hist.bins = 0;
+
+	if(pg->method == IMG_QUANT_OCTREE && init_octree(&pg->tree, maxcol) == -1) {
+		return -1;
+	}
+	if(pg->method != IMG_QUANT_OCTREE || pg->iter > 0) {
+		if(img_init_color_hist(&pg->hist, nchan) == -1) {
+			destroy_palgen(pg);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void destroy_palgen(struct img_palgen *pg)
+{
+	if(pg->tree.root) {
+		destroy_octree(&pg->tree);
+		pg->tree.root = 0;
+	}
+	img_destroy_color_hist(&pg->hist);
+}
+
+/* adds the colors of img to the palette generator, without modifying it */
+static int add_colors(struct img_palgen *pg, struct img_pixmap *img)
+{
+	if(pg->tree.root && build_octree(&pg->tree, img) == -1) {
+		return -1;
+	}
+	if(pg->hist.bins && img_color_hist_add(&pg->hist, img) == -1) {
+		return -1;
+	}
 	return 0;
 }
 
@@ -254,6 +592,7 @@ static int init_octree(struct octree *tree, int maxcol)
 	tree->maxcol = maxcol;
 
 	if(!(tree->root = alloc_node(tree, 0))) {
+		destroy_octree(tree);
 		return -1;
 	}
 	return 0;
@@ -261,25 +600,57 @@ static int init_octree(struct octree *tree, int maxcol)
 
 static void destroy_octree(struct octree *tree)
 {
-	free_tree(tree->root);
+	int i;
+	struct node_slab *slab;
+
+	for(i=0; i<NUM_LEVELS; i++) {
+		img_mem_free(tree->redheap[i].nodes);
+		tree->redheap[i].nodes = 0;
+	}
+
+	while(tree->slabs) {
+		slab = tree->slabs;
+		tree->slabs = slab->next;
+		img_mem_free(slab);
+	}
+	tree->freelist = 0;
+	tree->root = 0;
 }
 
 static struct octnode *alloc_node(struct octree *tree, int lvl)
 {
 	struct octnode *n;
+	struct node_slab *slab;
 
-	if(!(n = calloc(1, sizeof *n))) {
-		perror("failed to allocate octree node");
-		return 0;
+	if(tree->freelist) {
+		n = tree->freelist;
+		tree->freelist = n->next;
+	} else {
+		if(!tree->slabs || tree->slab_used >= SLAB_NODES) {
+			if(!(slab = img_mem_alloc(sizeof *slab))) {
+				perror("failed to allocate octree nodes");
+				return 0;
+			}
+			slab->next = tree->slabs;
+			tree->slabs = slab;
+			tree->slab_used = 0;
+		}
+		n = tree->slabs->nodes + tree->slab_used++;
 	}
+	memset(n, 0, sizeof *n);
 
 	n->lvl = lvl;
 	n->tree = tree;
 	n->palidx = -1;
+	n->heapidx = -1;
 
 	if(lvl < tree->redlev) {
-		n->next = tree->redlist[lvl];
-		tree->redlist[lvl] = n;
+		n->seq = tree->seq++;
+		if(heap_insert(tree->redheap + lvl, n) == -1) {
+			n->next = tree->freelist;
+			tree->freelist = n;
+			return 0;
+		}
 	} else {
 		n->leaf = 1;
 		tree->nleaves++;
@@ -289,46 +660,260 @@ static struct octnode *alloc_node(struct octree *tree, int lvl)
 
 static void free_node(struct octnode *n)
 {
-	struct octnode *prev, dummy;
-
-	dummy.next = n->tree->redlist[n->lvl];
-	prev = &dummy;
-	while(prev->next) {
-		if(prev->next == n) {
-			prev->next = n->next;
-			break;
-		}
-		prev = prev->next;
+	if(n->heapidx >= 0) {
+		heap_remove(n->tree->redheap + n->lvl, n);
 	}
-	n->tree->redlist[n->lvl] = dummy.next;
 
 	if(n->leaf) {
 		n->tree->nleaves--;
 		assert(n->tree->nleaves >= 0);
 	}
-	free(n);
+	n->next = n->tree->freelist;
+	n->tree->freelist = n;
 }
 
-static void free_tree(struct octnode *n)
+static int init_histogram(struct histogram *hist, size_t npix)
 {
-	int i;
+	int i, nslots;
 
-	if(!n) return;
+	hist->max_colors = npix < HIST_MAX_COLORS ? (npix > 0 ? npix : 1) : HIST_MAX_COLORS;
 
-	for(i=0; i<8; i++) {
-		free_tree(n->sub[i]);
+	/* at least twice as many slots as colors, to keep the load factor under 0.5 */
+	nslots = 2;
+	hist->hash_shift = 31;
+	while(nslots < hist->max_colors * 2) {
+		nslots <<= 1;
+		hist->hash_shift--;
+	}
+	hist->slot_mask = nslots - 1;
+
+	hist->colors = img_mem_alloc(hist->max_colors * sizeof *hist->colors);
+	hist->slots = img_mem_alloc(nslots * sizeof *hist->slots);
+	if(!hist->colors || !hist->slots) {
+		destroy_histogram(hist);
+		return -1;
+	}
+	for(i=0; i<nslots; i++) {
+		hist->slots[i] = -1;
+	}
+	hist->count = 0;
+	return 0;
+}
+
+static void destroy_histogram(struct histogram *hist)
+{
+	img_mem_free(hist->colors);
+	img_mem_free(hist->slots);
+	hist->colors = 0;
+	hist->slots = 0;
+}
+
+/* returns the entry for color rgb, adding it if it's not there, or null if
+ * the histogram is full.
+ */
+static struct hist_entry *hist_add(struct histogram *hist, unsigned int rgb)
+{
+	int idx;
+	unsigned int slot = (rgb * 2654435761u) >> hist->hash_shift;
+	struct hist_entry *ent;
+
+	while((idx = hist->slots[slot]) >= 0) {
+		if(hist->colors[idx].rgb == rgb) {
+			return hist->colors + idx;
+		}
+		slot = (slot + 1) & hist->slot_mask;
+	}
+
+	if(hist->count >= hist->max_colors) {
+		return 0;
+	}
+	hist->slots[slot] = hist->count;
+	ent = hist->colors + hist->count++;
+	ent->rgb = rgb;
+	ent->count = 0;
+	return ent;
+}
+
+/* adds all the colors of the histogram to the octree, and clears it.
+ * Returns whether it was worth it: if the colors averaged less than four pixels
+ * each, we'd better not bother with the histogram for this image.
+ */
+static int flush_histogram(struct histogram *hist, struct octree *tree)
+{
+	int i, ncol = hist->count;
+	long long npix = 0;
+	struct hist_entry *ent = hist->colors;
+
+	for(i=0; i<ncol; i++) {
+		insert_color(tree, ent->rgb, ent->count);
+		npix += ent->count;
+		ent++;
+	}
+	hist->count = 0;
+
+	for(i=0; i<=(int)hist->slot_mask; i++) {
+		hist->slots[i] = -1;
+	}
+	return npix >= 4 * (long long)ncol;
+}
+
+/* builds the octree from the colors of img, read as rgb24 */
+static int build_octree(struct octree *tree, struct img_pixmap *img)
+{
+	int i, j, n, nchunks, nhist;
+	size_t npix;
+	struct hist_job job;
+
+	if(img->width <= 0 || img->height <= 0) {
+		return 0;
+	}
+
+	if((job.chunk_rows = HIST_CHUNK_PIXELS / img->width) < 1) {
+		job.chunk_rows = 1;
+	}
+	nchunks = (img->height - 1) / job.chunk_rows + 1;
+	nhist = img_num_bands(nchunks, 1);
+
+	npix = (size_t)(img->height < job.chunk_rows ? img->height : job.chunk_rows) * img->width;
+	if(!(job.chunks = img_mem_alloc(nhist * sizeof *job.chunks))) {
+		return -1;
+	}
+	for(i=0; i<nhist; i++) {
+		job.chunks[i].rowbuf = 0;
+		if(img->fmt != IMG_FMT_RGB24 && !(job.chunks[i].rowbuf = img_mem_alloc((size_t)img->width * 3))) {
+			break;
+		}
+		if(init_histogram(&job.chunks[i].hist, npix) == -1) {
+			img_mem_free(job.chunks[i].rowbuf);
+			break;
+		}
+	}
+	if(i < nhist) {
+		while(--i >= 0) {
+			destroy_histogram(&job.chunks[i].hist);
+			img_mem_free(job.chunks[i].rowbuf);
+		}
+		img_mem_free(job.chunks);
+		return -1;
+	}
+	job.img = img;
+
+	/* count as many chunks at a time as we have histograms, then add them up */
+	for(i=0; i<nchunks; i+=nhist) {
+		n = nchunks - i < nhist ? nchunks - i : nhist;
+		job.first_row = i * job.chunk_rows;
+		img_parallel_for(n, n, count_chunk, &job);
+
+		for(j=0; j<n; j++) {
+			finish_chunk(tree, img, job.chunks + j);
+		}
+	}
+
+	for(i=0; i<nhist; i++) {
+		destroy_histogram(&job.chunks[i].hist);
+		img_mem_free(job.chunks[i].rowbuf);
+	}
+	img_mem_free(job.chunks);
+	return 0;
+}
+
+/* counts the colors of chunk number first chunk + band, until its histogram fills up */
+static void count_chunk(void *cls, int band, int start, int end)
+{
+	struct hist_job *job = cls;
+	struct hist_chunk *chunk = job->chunks + band;
+
+	chunk->row = job->first_row + band * job->chunk_rows;
+	chunk->col = 0;
+	if(job->img->height - chunk->row > job->chunk_rows) {
+		chunk->end = chunk->row + job->chunk_rows;
+	} else {
+		chunk->end = job->img->height;
+	}
+	count_colors(&chunk->hist, job->img, chunk->rowbuf, &chunk->row, &chunk->col, chunk->end);
+}
+
+/* adds the pixels from row, col up to row end to the histogram, and updates
+ * row and col to the first pixel it couldn't add, or end, 0 if they all fit.
+ * Rows are converted to rgb24 in buf if necessary.
+ */
+static void count_colors(struct histogram *hist, struct img_pixmap *img, unsigned char *buf,
+		int *row, int *col, int end)
+{
+	int i, j;
+	unsigned int key, prev_key = 0;
+	unsigned char *rgb;
+	struct hist_entry *ent = 0;
+
+	for(i=*row; i<end; i++) {
+		j = i == *row ? *col : 0;
+		rgb = img_get_row(buf, IMG_FMT_RGB24, img, i) + (size_t)j * 3;
+		for(; j<img->width; j++) {
+			key = ((unsigned int)rgb[0] << 16) | ((unsigned int)rgb[1] << 8) | rgb[2];
+
+			/* runs of the same color don't even need a hash lookup */
+			if(!ent || key != prev_key || ent->count >= INT_MAX) {
+				if(!(ent = hist_add(hist, key)) || ent->count >= INT_MAX) {
+					*row = i;
+					*col = j;
+					return;
+				}
+				prev_key = key;
+			}
+			ent->count++;
+			rgb += 3;
+		}
+	}
+	*row = end;
+	*col = 0;
+}
+
+/* adds the counted colors of a chunk to the octree, then goes through the rest
+ * of its pixels, if the histogram filled up before the end of the chunk.
+ */
+static void finish_chunk(struct octree *tree, struct img_pixmap *img, struct hist_chunk *chunk)
+{
+	int j, use_hist;
+	unsigned char *rgb;
+
+	use_hist = flush_histogram(&chunk->hist, tree);
+
+	while(chunk->row < chunk->end) {
+		if(use_hist) {
+			count_colors(&chunk->hist, img, chunk->rowbuf, &chunk->row, &chunk->col, chunk->end);
+			use_hist = flush_histogram(&chunk->hist, tree);
+			continue;
+		}
+
+		rgb = img_get_row(chunk->rowbuf, IMG_FMT_RGB24, img, chunk->row);
+		for(j=chunk->col; j<img->width; j++) {
+			insert_color(tree, ((unsigned int)rgb[j * 3] << 16) |
+					((unsigned int)rgb[j * 3 + 1] << 8) | rgb[j * 3 + 2], 1);
+		}
+		chunk->row++;
+		chunk->col = 0;
+	}
+}
+
+/* adds a packed rgb color to the octree, and reduces it back to maxcol colors */
+static void insert_color(struct octree *tree, unsigned int rgb, int count)
+{
+	add_color(tree, rgb >> 16, (rgb >> 8) & 0xff, rgb & 0xff, count);
+
+	while(tree->nleaves > tree->maxcol) {
+		reduce_colors(tree);
 	}
-	free_node(n);
 }
 
 static void add_color(struct octree *tree, int r, int g, int b, int nref)
 {
-	int i, idx, rr, gg, bb;
+	int i, idx;
+	long long rr, gg, bb;
 	struct octnode *n;
 
-	rr = r * nref;
-	gg = g * nref;
-	bb = b * nref;
+	rr = (long long)r * nref;
+	gg = (long long)g * nref;
+	bb = (long long)b * nref;
 
 	n = tree->root;
 	n->r += rr;
@@ -356,34 +941,106 @@ static void add_color(struct octree *tree, int r, int g, int b, int nref)
 	}
 }
 
+/* returns the reducible node with the fewest pixels, from the deepest level
+ * which still has any, and removes it from its heap.
+ */
 static struct octnode *get_reducible(struct octree *tree)
 {
-	int best_nref;
-	struct octnode dummy, *n, *prev, *best_prev, *best = 0;
+	struct octnode *n;
+	struct node_heap *heap;
 
 	while(tree->redlev >= 0) {
-		best_nref = INT_MAX;
-		best = 0;
-		dummy.next = tree->redlist[tree->redlev];
-		prev = &dummy;
-		while(prev->next) {
-			n = prev->next;
-			if(n->nref < best_nref) {
-				best = n;
-				best_nref = n->nref;
-				best_prev = prev;
+		heap = tree->redheap + tree->redlev;
+
+		while(heap->count > 0) {
+			n = heap->nodes[0];
+			if(n->heapkey == n->nref) {
+				heap_remove(heap, n);
+				return n;
 			}
-			prev = prev->next;
+			/* stale key, put it where it belongs now and try again */
+			n->heapkey = n->nref;
+			heap_sift_down(heap, 0);
+		}
+		tree->redlev--;
+	}
+	return 0;
+}
+
+#define HEAP_LESS(a, b) \
+	((a)->heapkey < (b)->heapkey || ((a)->heapkey == (b)->heapkey && (a)->seq > (b)->seq))
+
+static int heap_insert(struct node_heap *heap, struct octnode *n)
+{
+	int newsz;
+	struct octnode **newnodes;
+
+	if(heap->count >= heap->size) {
+		newsz = heap->size ? heap->size * 2 : 64;
+		if(!(newnodes = img_mem_realloc(heap->nodes, newsz * sizeof *newnodes))) {
+			return -1;
 		}
-		if(best) {
-			best_prev->next = best->next;
-			tree->redlist[tree->redlev] = dummy.next;
+		heap->nodes = newnodes;
+		heap->size = newsz;
+	}
+
+	n->heapkey = n->nref;
+	n->heapidx = heap->count;
+	heap->nodes[heap->count++] = n;
+	heap_sift_up(heap, n->heapidx);
+	return 0;
+}
+
+static void heap_remove(struct node_heap *heap, struct octnode *n)
+{
+	int idx = n->heapidx;
+	struct octnode *last = heap->nodes[--heap->count];
+
+	n->heapidx = -1;
+	if(last == n) return;
+
+	heap->nodes[idx] = last;
+	last->heapidx = idx;
+	heap_sift_up(heap, idx);
+	heap_sift_down(heap, last->heapidx);
+}
+
+static void heap_sift_down(struct node_heap *heap, int idx)
+{
+	int child;
+	struct octnode *n = heap->nodes[idx];
+
+	while((child = idx * 2 + 1) < heap->count) {
+		if(child + 1 < heap->count && HEAP_LESS(heap->nodes[child + 1], heap->nodes[child])) {
+			child++;
+		}
+		if(!HEAP_LESS(heap->nodes[child], n)) {
 			break;
 		}
-		tree->redlev--;
+		heap->nodes[idx] = heap->nodes[child];
+		heap->nodes[idx]->heapidx = idx;
+		idx = child;
 	}
+	heap->nodes[idx] = n;
+	n->heapidx = idx;
+}
+
+static void heap_sift_up(struct node_heap *heap, int idx)
+{
+	int parent;
+	struct octnode *n = heap->nodes[idx];
 
-	return best;
+	while(idx > 0) {
+		parent = (idx - 1) / 2;
+		if(!HEAP_LESS(n, heap->nodes[parent])) {
+			break;
+		}
+		heap->nodes[idx] = heap->nodes[parent];
+		heap->nodes[idx]->heapidx = idx;
+		idx = parent;
+	}
+	heap->nodes[idx] = n;
+	n->heapidx = idx;
 }
 
 static void reduce_colors(struct octree *tree)
@@ -417,6 +1074,7 @@ static int assign_colors(struct octnode *n, int next, struct img_colormap *cmap)
 		cmap->color[next].r = n->r / n->nref;
 		cmap->color[next].g = n->g / n->nref;
 		cmap->color[next].b = n->b / n->nref;
+		cmap->alpha[next] = 255;
 		n->palidx = next;
 		return next + 1;
 	}
@@ -427,29 +1085,579 @@ static int assign_colors(struct octnode *n, int next, struct img_colormap *cmap)
 	return next;
 }
 
-static int lookup_color(struct octree *tree, int r, int g, int b)
+static int init_inv_colormap(struct inv_colormap *inv, struct img_colormap *cmap, int nchan)
 {
-	int i, j, idx;
-	struct octnode *n;
+	int i, ncells, offs;
+	struct candidate *cand;
+
+	inv->nchan = nchan;
+	inv->cand = 0;
+	inv->cand_size = inv->cand_max = 0;
+	inv->cmap = cmap;
+	inv->last_rgb = -1;
+	inv->last_idx = 0;
+	inv->cell[0] = 0;
+	inv->cache = 0;
+
+	if(nchan == 4) {
+		if(!(inv->cache = img_mem_alloc((1 << RGBA_CACHE_BITS) * sizeof *inv->cache))) {
+			return -1;
+		}
+		for(i=0; i<1 << RGBA_CACHE_BITS; i++) {
+			inv->cache[i].idx = -1;
+		}
+		return 0;
+	}
 
-	n = tree->root;
-	for(i=0; i<NUM_LEVELS; i++) {
-		if(n->leaf) {
-			assert(n->palidx >= 0);
-			return n->palidx;
+	ncells = 0;
+	for(i=0; i<LUT_LEVELS; i++) {
+		ncells += 1 << (3 * lut_bits[i]);
+	}
+	if(!(inv->cell[0] = img_mem_alloc(ncells * sizeof *inv->cell[0]))) {
+		return -1;
+	}
+	memset(inv->cell[0], 0xff, ncells * sizeof *inv->cell[0]);
+	for(i=1; i<LUT_LEVELS; i++) {
+		inv->cell[i] = inv->cell[i - 1] + (1 << (3 * lut_bits[i - 1]));
+	}
+
+	/* the whole palette is the candidate list of the root */
+	if(cmap->ncolors <= 1) {
+		inv->root = 0;
+		return 0;
+	}
+	if(!(cand = alloc_candidates(inv, cmap->ncolors, &offs))) {
+		destroy_inv_colormap(inv);
+		return -1;
+	}
+	for(i=0; i<cmap->ncolors; i++) {
+		cand[i].idx = i;
+		cand[i].dist = 0;
+	}
+	inv->root = CELL_LIST(offs);
+	return 0;
+}
+
+static void destroy_inv_colormap(struct inv_colormap *inv)
+{
+	img_mem_free(inv->cell[0]);
+	img_mem_free(inv->cand);
+	img_mem_free(inv->cache);
+	inv->cell[0] = 0;
+	inv->cand = 0;
+	inv->cache = 0;
+}
+
+/* maps an rgb24 or rgba32 pixel, depending on the inverse colormap */
+static int map_pixel(struct inv_colormap *inv, unsigned char *pix)
+{
+	if(inv->nchan == 4) {
+		return map_color_rgba(inv, pix);
+	}
+	return map_color(inv, pix[0], pix[1], pix[2]);
+}
+
+/* returns the exact nearest palette color by euclidean distance (ties go to
+ * the lowest index), or -1 if we ran out of memory
+ */
+static int map_color(struct inv_colormap *inv, int r, int g, int b)
+{
+	int i, n, idx, dr, dg, db, dist, best, best_idx, entry;
+	int rgb = (r << 16) | (g << 8) | b;
+	struct candidate *cand;
+	struct img_colormap *cmap = inv->cmap;
+
+	if((entry = get_cell(inv, LUT_LEVELS - 1, r, g, b)) < 256) {
+		return entry;
+	}
+
+	if(rgb == inv->last_rgb) {
+		return inv->last_idx;
+	}
+
+	cand = inv->cand + entry - 256;
+	n = cand->dist;
+	cand++;
+
+	best = INT_MAX;
+	best_idx = 0;
+	for(i=0; i<n; i++) {
+		if(cand[i].dist > best) break;	/* can't get any closer after this */
+		idx = cand[i].idx;
+		dr = cmap->color[idx].r - r;
+		dg = cmap->color[idx].g - g;
+		db = cmap->color[idx].b - b;
+		dist = dr * dr + dg * dg + db * db;
+		if(dist < best || (dist == best && idx < best_idx)) {
+			best = dist;
+			best_idx = idx;
 		}
+	}
 
-		idx = subidx(i, r, g, b);
-		for(j=0; j<8; j++) {
-			if(n->sub[idx]) break;
-			idx = (idx + 1) & 7;
+	inv->last_rgb = rgb;
+	inv->last_idx = best_idx;
+	return best_idx;
+}
+
+/* returns the nearest palette color to an rgba32 pixel, by euclidean distance
+ * over all four channels, like map_color. Fully transparent pixels are matched
+ * as transparent black, the same way they're counted for the palette.
+ */
+static int map_color_rgba(struct inv_colormap *inv, unsigned char *pix)
+{
+	int i, r, g, b, a, dr, dg, db, da, dist, best, best_idx;
+	unsigned int rgba;
+	struct rgba_cache *entry;
+	struct img_colormap *cmap = inv->cmap;
+
+	r = pix[0];
+	g = pix[1];
+	b = pix[2];
+	if(!(a = pix[3])) {
+		r = g = b = 0;
+	}
+	rgba = ((unsigned int)r << 24) | (g << 16) | (b << 8) | a;
+
+	entry = inv->cache + ((rgba * 2654435761u) >> (32 - RGBA_CACHE_BITS));
+	if(entry->idx >= 0 && entry->rgba == rgba) {
+		return entry->idx;
+	}
+
+	best = INT_MAX;
+	best_idx = 0;
+	for(i=0; i<cmap->ncolors; i++) {
+		dr = cmap->color[i].r - r;
+		dg = cmap->color[i].g - g;
+		db = cmap->color[i].b - b;
+		da = cmap->alpha[i] - a;
+		dist = dr * dr + dg * dg + db * db + da * da;
+		if(dist < best) {
+			best = dist;
+			best_idx = i;
 		}
+	}
 
-		assert(n->sub[idx]);
-		n = n->sub[idx];
+	entry->rgba = rgba;
+	entry->idx = best_idx;
+	return best_idx;
+}
+
+/* returns the table entry of the cell containing r,g,b at level lvl, building
+ * it (and its parents) if necessary, or -1 on failure.
+ */
+static int get_cell(struct inv_colormap *inv, int lvl, int r, int g, int b)
+{
+	int parent, cell = LUT_CELL(lut_bits[lvl], r, g, b);
+	int *entry = inv->cell[lvl] + cell;
+
+	if(*entry == CELL_EMPTY) {
+		parent = lvl > 0 ? get_cell(inv, lvl - 1, r, g, b) : inv->root;
+		if(parent < 256) {
+			/* parent is either a single color, which covers us too, or failed */
+			return *entry = parent;
+		}
+		*entry = build_cell(inv, lvl, cell, parent);
+	}
+	return *entry;
+}
+
+/* distance of c from the nearest and the farthest point of [lo, hi] */
+#define AXIS_DIST(c, lo, hi, mind, maxd) \
+	do { \
+		int d0_ = (c) - (lo), d1_ = (hi) - (c); \
+		maxd = d0_ > d1_ ? d0_ : d1_; \
+		mind = d0_ < 0 ? -d0_ : (d1_ < 0 ? -d1_ : 0); \
+	} while(0)
+
+/* finds the candidates of a cell among the candidates of its parent, and
+ * returns its table entry, or -1 on failure. A color is a candidate if its
+ * distance from the nearest point of the cell doesn't exceed the smallest
+ * distance of any color from the farthest point.
+ */
+static int build_cell(struct inv_colormap *inv, int lvl, int cell, int parent)
+{
+	int i, j, n, pcount, offs, minmax, dmax;
+	int rlo, glo, blo, rhi, ghi, bhi, mr, mg, mb, xr, xg, xb;
+	int bits = lut_bits[lvl];
+	struct img_colormap *cmap = inv->cmap;
+	struct candidate *cand, *pcand;
+	struct candidate tmp[256], c;
+
+	rlo = (cell >> (2 * bits)) << (8 - bits);
+	glo = ((cell >> bits) & ((1 << bits) - 1)) << (8 - bits);
+	blo = (cell & ((1 << bits) - 1)) << (8 - bits);
+	rhi = rlo + (1 << (8 - bits)) - 1;
+	ghi = glo + (1 << (8 - bits)) - 1;
+	bhi = blo + (1 << (8 - bits)) - 1;
+
+	pcand = inv->cand + parent - 256;
+	pcount = pcand->dist;
+	pcand++;
+
+	minmax = INT_MAX;
+	for(i=0; i<pcount; i++) {
+		j = pcand[i].idx;
+		AXIS_DIST(cmap->color[j].r, rlo, rhi, mr, xr);
+		AXIS_DIST(cmap->color[j].g, glo, ghi, mg, xg);
+		AXIS_DIST(cmap->color[j].b, blo, bhi, mb, xb);
+		dmax = xr * xr + xg * xg + xb * xb;
+		if(dmax < minmax) minmax = dmax;
+		tmp[i].idx = j;
+		tmp[i].dist = mr * mr + mg * mg + mb * mb;
+	}
+
+	n = 0;
+	for(i=0; i<pcount; i++) {
+		if(tmp[i].dist <= minmax) {
+			tmp[n++] = tmp[i];
+		}
+	}
+	if(lvl == LUT_LEVELS - 1) {
+		/* sort the final lists by distance from the cell, for map_color */
+		for(i=1; i<n; i++) {
+			c = tmp[i];
+			for(j=i; j>0 && tmp[j - 1].dist > c.dist; j--) {
+				tmp[j] = tmp[j - 1];
+			}
+			tmp[j] = c;
+		}
+	}
+	if(n == 1) {
+		return tmp[0].idx;	/* the whole cell maps to the same color */
+	}
+
+	if(!(cand = alloc_candidates(inv, n, &offs))) {
+		return -1;
+	}
+	memcpy(cand, tmp, n * sizeof *cand);
+	return CELL_LIST(offs);
+}
+
+/* allocates a candidate list of count entries, returns a pointer to the first
+ * one, and its offset in the candidate pool in offs.
+ */
+static struct candidate *alloc_candidates(struct inv_colormap *inv, int count, int *offs)
+{
+	int newmax;
+	struct candidate *tmp;
+
+	if(inv->cand_size + count + 1 > inv->cand_max) {
+		newmax = inv->cand_max ? inv->cand_max * 2 : 4096;
+		while(newmax < inv->cand_size + count + 1) newmax *= 2;
+		if(!(tmp = img_mem_realloc(inv->cand, newmax * sizeof *inv->cand))) {
+			return 0;
+		}
+		inv->cand = tmp;
+		inv->cand_max = newmax;
+	}
+	*offs = inv->cand_size;
+	tmp = inv->cand + inv->cand_size;
+	tmp->idx = -1;
+	tmp->dist = count;
+	inv->cand_size += count + 1;
+	return tmp + 1;
+}
+
+/* maps the pixels of src, read as rgb24 or rgba32 (nchan 3 or 4), to the
+ * palette, in bands of rows, optionally with ordered dithering
+ */
+static int map_pixels(struct img_pixmap *dest, struct img_pixmap *src, int nchan,
+		struct img_colormap *cmap, struct dither_pattern *dither)
+{
+	int i, res = 0, nbands = 1;
+	struct map_job job;
+
+	if(src->width > 0) {
+		nbands = img_num_bands(src->height, MAP_MIN_PIXELS / src->width);
+	}
+	if(!(job.status = img_mem_alloc(nbands * sizeof *job.status))) {
+		return -1;
+	}
+	job.dest = dest;
+	job.src = src;
+	job.nchan = nchan;
+	job.fmt = nchan == 4 ? IMG_FMT_RGBA32 : IMG_FMT_RGB24;
+	job.cmap = cmap;
+	job.dither = dither;
+
+	img_parallel_for(src->height, nbands, map_band, &job);
+
+	for(i=0; i<nbands; i++) {
+		if(job.status[i] == -1) res = -1;
+	}
+	img_mem_free(job.status);
+	return res;
+}
+
+/* maps rows [start, end) of the image */
+static void map_band(void *cls, int band, int start, int end)
+{
+	int i, j, cidx, y, nchan;
+	struct map_job *job = cls;
+	struct dither_pattern *dither = job->dither;
+	struct inv_colormap inv;
+	unsigned char *dest, *pix, *row = 0;
+
+	/* rows are converted and dithered in row, when necessary */
+	nchan = job->nchan;
+	job->status[band] = -1;
+	if((dither || job->src->fmt != job->fmt) && !(row = img_mem_alloc((size_t)job->src->width * nchan))) {
+		return;
+	}
+	if(init_inv_colormap(&inv, job->cmap, nchan) == -1) {
+		img_mem_free(row);
+		return;
+	}
+
+	for(i=start; i<end; i++) {
+		dest = (unsigned char*)job->dest->pixels + (size_t)i * job->dest->pitch;
+		pix = img_get_row(row, job->fmt, job->src, i);
+		if(dither) {
+			y = i & (dither->size - 1);
+			add_dither(row, pix, dither->pos[y], dither->neg[y], dither->row_size,
+					job->src->width * nchan);
+			pix = row;
+		}
+		for(j=0; j<job->src->width; j++) {
+			if((cidx = map_pixel(&inv, pix)) == -1) {
+				destroy_inv_colormap(&inv);
+				img_mem_free(row);
+				return;
+			}
+			*dest++ = cidx;
+			pix += nchan;
+		}
+	}
+
+	destroy_inv_colormap(&inv);
+	img_mem_free(row);
+	job->status[band] = 0;
+}
+
+/* Floyd-Steinberg dithering of src, read as rgb24 or rgba32 (nchan 3 or 4),
+ * into dest. Only the color channels are dithered, alpha is mapped as it is.
+ */
+static int dither_fs(struct img_pixmap *dest, struct img_pixmap *src, int nchan,
+		struct img_colormap *cmap)
+{
+	int i, res, nworkers = 1;
+	struct fs_job job;
+
+	if(src->width <= 0 || src->height <= 0) {
+		return 0;
+	}
+	if(src->width > INT_MAX / 3 - 2) {
+		return -1;
+	}
+
+	nworkers = img_num_bands(src->height, MAP_MIN_PIXELS / src->width);
+
+	job.dest = dest;
+	job.src = src;
+	job.nchan = nchan;
+	job.fmt = nchan == 4 ? IMG_FMT_RGBA32 : IMG_FMT_RGB24;
+	job.cmap = cmap;
+	job.num_err_rows = nworkers + 1;
+	job.err_pitch = (src->width + 2) * 3;	/* plus a pixel of padding on each side */
+
+	job.err = img_mem_alloc((size_t)job.num_err_rows * job.err_pitch * sizeof *job.err);
+	job.inv = img_mem_alloc(nworkers * sizeof *job.inv);
+	job.status = img_mem_alloc(nworkers * sizeof *job.status);
+	job.rowbuf = 0;
+	if(src->fmt != job.fmt) {
+		job.rowbuf = img_mem_alloc((size_t)nworkers * src->width * nchan);
+	}
+	if(!job.err || !job.inv || !job.status || (src->fmt != job.fmt && !job.rowbuf)) {
+		img_mem_free(job.err);
+		img_mem_free(job.inv);
+		img_mem_free(job.status);
+		img_mem_free(job.rowbuf);
+		return -1;
+	}
+	/* the first row starts with no error */
+	memset(job.err, 0, job.err_pitch * sizeof *job.err);
+
+	res = 0;
+	for(i=0; i<nworkers; i++) {
+		if(init_inv_colormap(job.inv + i, cmap, job.nchan) == -1) {
+			nworkers = i;
+			res = -1;
+			break;
+		}
+		job.status[i] = 0;
+	}
+
+	/* each step waits for the row above to be done with the error it pushes
+	 * down to the pixels of the step, and the one to the right of it
+	 */
+	if(res != -1) {
+		res = img_parallel_wave(src->height, src->width, FS_STEP, 2, nworkers, dither_fs_step, &job);
 	}
 
-	return 0;	/* lookup_color failed */
+	for(i=0; i<nworkers; i++) {
+		if(job.status[i] == -1) res = -1;
+		destroy_inv_colormap(job.inv + i);
+	}
+	img_mem_free(job.err);
+	img_mem_free(job.inv);
+	img_mem_free(job.status);
+	img_mem_free(job.rowbuf);
+	return res;
+}
+
+/* dithers pixels [start, end) of a row. A worker does all the steps of its
+ * rows, so it converts the whole row in its first step, if necessary.
+ */
+static void dither_fs_step(void *cls, int worker, int row, int start, int end)
+{
+	int i, j, cidx, val, err[3];
+	struct fs_job *job = cls;
+	struct img_colormap *cmap = job->cmap;
+	unsigned char *src, *dest, *buf = 0, pix[4];
+	short *cur, *next;
+
+	if(job->rowbuf) {
+		buf = job->rowbuf + (size_t)worker * job->src->width * job->nchan;
+	}
+	if(start == 0 || !buf) {
+		src = img_get_row(buf, job->fmt, job->src, row);
+	} else {
+		src = buf;
+	}
+	src += (size_t)start * job->nchan;
+	dest = (unsigned char*)job->dest->pixels + (size_t)row * job->dest->pitch + start;
+	cur = job->err + (size_t)(row % job->num_err_rows) * job->err_pitch + start * 3 + 3;
+	next = job->err + (size_t)((row + 1) % job->num_err_rows) * job->err_pitch + start * 3 + 3;
+
+	if(start == 0) {
+		/* every element of the next row is set before it's added to, except these */
+		for(i=-3; i<3; i++) {
+			next[i] = 0;
+		}
+	}
+
+	for(j=start; j<end; j++) {
+		for(i=0; i<3; i++) {
+			val = src[i] + (cur[i] >= 0 ? cur[i] + 8 : cur[i] - 8) / 16;
+			pix[i] = CLAMP(val, 0, 255);
+		}
+		if(job->nchan == 4) {
+			pix[3] = src[3];
+		}
+		if((cidx = map_pixel(job->inv + worker, pix)) == -1) {
+			job->status[worker] = -1;
+			cidx = 0;
+		}
+		*dest++ = cidx;
+
+		if(job->nchan == 4 && !pix[3]) {
+			/* the color of invisible pixels doesn't matter, don't spread it */
+			err[0] = err[1] = err[2] = 0;
+		} else {
+			err[0] = pix[0] - cmap->color[cidx].r;
+			err[1] = pix[1] - cmap->color[cidx].g;
+			err[2] = pix[2] - cmap->color[cidx].b;
+		}
+		for(i=0; i<3; i++) {
+			cur[i + 3] += 7 * err[i];
+			next[i - 3] += 3 * err[i];
+			next[i] += 5 * err[i];
+			next[i + 3] = err[i];
+		}
+
+		src += job->nchan;
+		cur += 3;
+		next += 3;
+	}
+}
+
+/* Builds the offsets of a size x size Bayer matrix, centered around zero, and
+ * scaled to the average distance between each palette color and its nearest
+ * neighbour. The offsets are added to all color channels alike, so the distance
+ * is measured along the channel that differs the most. Colors that only differ
+ * in alpha don't count as neighbours.
+ */
+static void init_dither_pattern(struct dither_pattern *pat, int size, struct img_colormap *cmap,
+		int nchan)
+{
+	int i, j, k, x, y, val, dist, mindist, spread;
+	long sum = 0;
+
+	for(i=0; i<cmap->ncolors; i++) {
+		mindist = 256;
+		for(j=0; j<cmap->ncolors; j++) {
+			if(j == i) continue;
+			dist = abs(cmap->color[i].r - cmap->color[j].r);
+			y = abs(cmap->color[i].g - cmap->color[j].g);
+			if(y > dist) dist = y;
+			y = abs(cmap->color[i].b - cmap->color[j].b);
+			if(y > dist) dist = y;
+			if(dist > 0 && dist < mindist) mindist = dist;
+		}
+		sum += mindist;
+	}
+	spread = cmap->ncolors > 1 ? (sum + cmap->ncolors / 2) / cmap->ncolors : 0;
+
+	pat->size = size;
+	pat->row_size = DITHER_MAX_SIZE * nchan;
+	for(i=0; i<size; i++) {
+		for(j=0; j<DITHER_MAX_SIZE; j++) {
+			/* the bits of the matrix element are the bits of x ^ y and y,
+			 * interleaved in reverse order
+			 */
+			x = j & (size - 1);
+			y = i;
+			val = 0;
+			for(k=1; k<size; k<<=1) {
+				val = (val << 2) | ((((x ^ y) & 1) << 1) | (y & 1));
+				x >>= 1;
+				y >>= 1;
+			}
+			val = (2 * val + 1) * spread / (2 * size * size) - spread / 2;
+
+			for(k=0; k<nchan; k++) {
+				pat->pos[i][j * nchan + k] = val > 0 && k < 3 ? val : 0;
+				pat->neg[i][j * nchan + k] = val < 0 && k < 3 ? -val : 0;
+			}
+		}
+	}
+}
+
+/* adds the dithering offsets of a row of the matrix, row_size bytes long (a
+ * multiple of 16), to nbytes bytes of rgb24 or rgba32 pixels
+ */
+static void add_dither(unsigned char *dest, unsigned char *src, unsigned char *pos,
+		unsigned char *neg, int row_size, int nbytes)
+{
+	int i = 0, j, val;
+
+#ifdef DITHER_SSE2
+	__m128i v;
+
+	for(; i<=nbytes - row_size; i+=row_size) {
+		for(j=0; j<row_size; j+=16) {
+			v = _mm_loadu_si128((__m128i*)(src + i + j));
+			v = _mm_adds_epu8(v, _mm_loadu_si128((__m128i*)(pos + j)));
+			v = _mm_subs_epu8(v, _mm_loadu_si128((__m128i*)(neg + j)));
+			_mm_storeu_si128((__m128i*)(dest + i + j), v);
+		}
+	}
+#elif defined(DITHER_NEON)
+	uint8x16_t v;
+
+	for(; i<=nbytes - row_size; i+=row_size) {
+		for(j=0; j<row_size; j+=16) {
+			v = vqaddq_u8(vld1q_u8(src + i + j), vld1q_u8(pos + j));
+			vst1q_u8(dest + i + j, vqsubq_u8(v, vld1q_u8(neg + j)));
+		}
+	}
+#endif
+
+	for(; i<nbytes; i++) {
+		j = i % row_size;
+		val = (int)src[i] + pos[j] - neg[j];
+		dest[i] = CLAMP(val, 0, 255);
+	}
 }
 
 static int subidx(int bit, int r, int g, int b)
@@ -475,8 +1683,8 @@ static void print_tree(struct octnode *n, int lvl)
 	p = ptrbuf + strlen(ptrbuf) - 4;
 
 	if(n->nref) {
-		printf("+-(%d) %s: <%d %d %d> #%d", n->lvl, p, n->r / n->nref, n->g / n->nref,
-				n->b / n->nref, n->nref);
+		printf("+-(%d) %s: <%d %d %d> #%lld", n->lvl, p, (int)(n->r / n->nref),
+				(int)(n->g / n->nref), (int)(n->b / n->nref), n->nref);
 	} else {
 		printf("+-(%d) %s: <- - -> #0", n->lvl, p);
 	}
@@ -0,0 +1,343 @@
+/*
+libimago - a multi-format image file input/output library.
+Copyright (C) 2010-2026 John Tsiombikas <nuclear@mutantstargoat.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* internal thread pool, used to process large images in bands of rows */
+#include <stdlib.h>
+#include "imago2.h"
+#include "thrpool.h"
+#include "alloc.h"
+
+#if !defined(NO_THREADS) && (defined(__unix__) || defined(__APPLE__) || defined(__MINGW32__))
+#define USE_PTHREADS
+#include <pthread.h>
+#include <unistd.h>
+#include <sched.h>
+
+/* wavefront progress counters are polled by one thread while another one
+ * updates them, see img_parallel_wave. They're sequentially consistent, so
+ * that a waiter going to sleep and a worker storing progress can't both miss
+ * each other, see wait_progress.
+ */
+#define LOAD_PROGRESS(p)		__atomic_load_n(&(p), __ATOMIC_SEQ_CST)
+#define STORE_PROGRESS(p, x)	__atomic_store_n(&(p), (x), __ATOMIC_SEQ_CST)
+#define NEXT_ROW(r)				__atomic_fetch_add(&(r), 1, __ATOMIC_RELAXED)
+/* the thread count can be changed while another thread is using the pool */
+#define LOAD_SETTING(x)			__atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define STORE_SETTING(x, v)		__atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+#else
+#define LOAD_PROGRESS(p)		(p)
+#define STORE_PROGRESS(p, x)	((p) = (x))
+#define NEXT_ROW(r)				((r)++)
+#define LOAD_SETTING(x)			(x)
+#define STORE_SETTING(x, v)		((x) = (v))
+#endif
+
+#define MAX_THREADS		64
+/* times to yield waiting for the row above, before going to sleep */
+#define WAVE_SPINS		64
+
+#define BAND_START(b, count, nbands)	(int)((long long)(b) * (count) / (nbands))
+
+static int num_threads;	/* 0: one per CPU */
+
+struct wave_job {
+	img_wave_func func;
+	void *cls;
+	int rows, cols, step, lag;
+	int next_row;
+	int *progress;	/* columns done in each row */
+#ifdef USE_PTHREADS
+	pthread_mutex_t lock;
+	pthread_cond_t cond;	/* signalled on progress, when anyone's asleep */
+	int sleeping;
+#endif
+};
+
+static void wave_band(void *cls, int band, int start, int end);
+static void wait_progress(struct wave_job *wave, int row, int need);
+static void set_progress(struct wave_job *wave, int row, int done);
+
+#ifdef USE_PTHREADS
+static void run_bands(void);
+static void *worker(void *arg);
+static void stop_workers(void) __attribute__((destructor));
+
+/* job_lock is held for the whole duration of a parallel job, pool_lock
+ * protects the job state, the worker count and the quit flag.
+ */
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t workers[MAX_THREADS];
+static int num_workers, quit;
+
+static struct {
+	img_band_func func;
+	void *cls;
+	int count, nbands;
+	int next_band, pending;
+} job;
+#endif
+
+
+void img_set_num_threads(int n)
+{
+	if(n < 0) n = 0;
+	if(n > MAX_THREADS) n = MAX_THREADS;
+	STORE_SETTING(num_threads, n);
+}
+
+int img_get_num_threads(void)
+{
+#ifdef USE_PTHREADS
+	static int num_cpus;
+	int nthr;
+	long n = 1;
+
+	if((nthr = LOAD_SETTING(num_threads)) > 0) {
+		return nthr;
+	}
+	if(!(nthr = LOAD_SETTING(num_cpus))) {
+#ifdef _SC_NPROCESSORS_ONLN
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+		nthr = n < 1 ? 1 : (n > MAX_THREADS ? MAX_THREADS : n);
+		STORE_SETTING(num_cpus, nthr);
+	}
+	return nthr;
+#else
+	return 1;
+#endif
+}
+
+int img_num_bands(int count, int min_band)
+{
+	int nbands, nthr = img_get_num_threads();
+
+	if(min_band < 1) min_band = 1;
+	nbands = count / min_band;
+
+	if(nbands < 1) return 1;
+	return nbands > nthr ? nthr : nbands;
+}
+
+void img_parallel_for(int count, int nbands, img_band_func func, void *cls)
+{
+	int i;
+
+#ifdef USE_PTHREADS
+	/* if another thread is using the pool, don't wait for it, just do it ourselves */
+	if(nbands > 1 && pthread_mutex_trylock(&job_lock) == 0) {
+		pthread_mutex_lock(&pool_lock);
+
+		while(num_workers < nbands - 1 && num_workers < MAX_THREADS) {
+			if(pthread_create(workers + num_workers, 0, worker, 0) != 0) {
+				break;
+			}
+			num_workers++;
+		}
+
+		job.func = func;
+		job.cls = cls;
+		job.count = count;
+		job.nbands = nbands;
+		job.next_band = 0;
+		job.pending = nbands;
+		pthread_cond_broadcast(&work_cond);
+
+		/* the calling thread works on the job too, then waits for the rest */
+		run_bands();
+		while(job.pending > 0) {
+			pthread_cond_wait(&done_cond, &pool_lock);
+		}
+
+		pthread_mutex_unlock(&pool_lock);
+		pthread_mutex_unlock(&job_lock);
+		return;
+	}
+#endif
+
+	for(i=0; i<nbands; i++) {
+		func(cls, i, BAND_START(i, count, nbands), BAND_START(i + 1, count, nbands));
+	}
+}
+
+int img_parallel_wave(int rows, int cols, int step, int lag, int nworkers, img_wave_func func, void *cls)
+{
+	int i;
+	struct wave_job wave;
+
+	if(rows <= 0) return 0;
+
+	if(!(wave.progress = img_mem_alloc(rows * sizeof *wave.progress))) {
+		return -1;
+	}
+	for(i=0; i<rows; i++) {
+		wave.progress[i] = 0;
+	}
+	wave.func = func;
+	wave.cls = cls;
+	wave.rows = rows;
+	wave.cols = cols;
+	wave.step = step < 1 ? 1 : step;
+	wave.lag = lag;
+	wave.next_row = 0;
+#ifdef USE_PTHREADS
+	pthread_mutex_init(&wave.lock, 0);
+	pthread_cond_init(&wave.cond, 0);
+	wave.sleeping = 0;
+#endif
+
+	/* Rows are handed out in order, and only wait for rows that someone's
+	 * already working on, so this can't deadlock, even if the bands end up
+	 * running one after the other: then the first one just does all the rows.
+	 */
+	img_parallel_for(nworkers, nworkers, wave_band, &wave);
+
+#ifdef USE_PTHREADS
+	pthread_cond_destroy(&wave.cond);
+	pthread_mutex_destroy(&wave.lock);
+#endif
+	img_mem_free(wave.progress);
+	return 0;
+}
+
+static void wave_band(void *cls, int band, int start, int end)
+{
+	int row, col, next, need;
+	struct wave_job *wave = cls;
+
+	while((row = NEXT_ROW(wave->next_row)) < wave->rows) {
+		for(col=0; col<wave->cols; col=next) {
+			next = wave->cols - col > wave->step ? col + wave->step : wave->cols;
+
+			if(row > 0) {
+				need = wave->cols - next > wave->lag ? next + wave->lag : wave->cols;
+				wait_progress(wave, row - 1, need);
+			}
+			wave->func(wave->cls, band, row, col, next);
+			set_progress(wave, row, next);
+		}
+	}
+}
+
+/* waits until the given row is done up to column need. The row is being worked
+ * on by another thread, which is usually just a step ahead, so yield for a
+ * while first, and only go to sleep if that's not enough.
+ */
+static void wait_progress(struct wave_job *wave, int row, int need)
+{
+#ifdef USE_PTHREADS
+	int i;
+
+	for(i=0; i<WAVE_SPINS; i++) {
+		if(LOAD_PROGRESS(wave->progress[row]) >= need) {
+			return;
+		}
+		sched_yield();
+	}
+
+	pthread_mutex_lock(&wave->lock);
+	STORE_PROGRESS(wave->sleeping, wave->sleeping + 1);
+	while(LOAD_PROGRESS(wave->progress[row]) < need) {
+		pthread_cond_wait(&wave->cond, &wave->lock);
+	}
+	STORE_PROGRESS(wave->sleeping, wave->sleeping - 1);
+	pthread_mutex_unlock(&wave->lock);
+#endif
+}
+
+static void set_progress(struct wave_job *wave, int row, int done)
+{
+	STORE_PROGRESS(wave->progress[row], done);
+#ifdef USE_PTHREADS
+	if(LOAD_PROGRESS(wave->sleeping)) {
+		pthread_mutex_lock(&wave->lock);
+		pthread_cond_broadcast(&wave->cond);
+		pthread_mutex_unlock(&wave->lock);
+	}
+#endif
+}
+
+#ifdef USE_PTHREADS
+/* grabs and processes bands of the current job until there are none left.
+ * must be called with pool_lock held.
+ */
+static void run_bands(void)
+{
+	int band, start, end;
+	img_band_func func;
+	void *cls;
+
+	while(job.next_band < job.nbands) {
+		band = job.next_band++;
+		func = job.func;
+		cls = job.cls;
+		start = BAND_START(band, job.count, job.nbands);
+		end = BAND_START(band + 1, job.count, job.nbands);
+
+		pthread_mutex_unlock(&pool_lock);
+		func(cls, band, start, end);
+		pthread_mutex_lock(&pool_lock);
+
+		if(--job.pending == 0) {
+			pthread_cond_signal(&done_cond);
+		}
+	}
+}
+
+static void *worker(void *arg)
+{
+	pthread_mutex_lock(&pool_lock);
+	for(;;) {
+		while(!quit && job.next_band >= job.nbands) {
+			pthread_cond_wait(&work_cond, &pool_lock);
+		}
+		if(quit) break;
+		run_bands();
+	}
+	pthread_mutex_unlock(&pool_lock);
+	return 0;
+}
+
+/* runs when the library is unloaded (or at exit), and joins the workers, so
+ * that none of them is left running code that's no longer there. job_lock is
+ * never released, so any later parallel job runs on the calling thread. If a
+ * job is still running at this point, the workers are busy with it and can't
+ * be stopped, so they're left alone.
+ */
+static void stop_workers(void)
+{
+	int i;
+
+	if(pthread_mutex_trylock(&job_lock) != 0) {
+		return;
+	}
+
+	pthread_mutex_lock(&pool_lock);
+	quit = 1;
+	pthread_cond_broadcast(&work_cond);
+	pthread_mutex_unlock(&pool_lock);
+
+	for(i=0; i<num_workers; i++) {
+		pthread_join(workers[i], 0);
+	}
+	num_workers = 0;
+}
+#endif
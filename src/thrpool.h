@@ -0,0 +1,51 @@
+/*
+libimago - a multi-format image file input/output library.
+Copyright (C) 2010-2026 John Tsiombikas <nuclear@mutantstargoat.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef IMAGO_THRPOOL_H_
+#define IMAGO_THRPOOL_H_
+
+/* processes band number "band", which is the range [start, end) of a parallel job */
+typedef void (*img_band_func)(void *cls, int band, int start, int end);
+
+/* returns the number of bands to split count items into, so that each band has
+ * at least min_band items, and there are no more bands than threads.
+ */
+int img_num_bands(int count, int min_band);
+
+/* Splits the range [0, count) into nbands contiguous bands, with band i
+ * covering [i * count / nbands, (i + 1) * count / nbands), and calls func for
+ * each one on the internal thread pool. Returns after all bands are done.
+ * If the pool is busy with another job, or multithreading is disabled, the
+ * bands are processed one after the other on the calling thread instead.
+ */
+void img_parallel_for(int count, int nbands, img_band_func func, void *cls);
+
+/* processes columns [start, end) of a row of a wavefront job, on the given worker */
+typedef void (*img_wave_func)(void *cls, int worker, int row, int start, int end);
+
+/* Processes rows [0, rows) of cols columns each, top to bottom, on up to
+ * nworkers threads of the internal thread pool. Each worker takes the next
+ * row, and goes through it in steps of step columns, but only starts a step
+ * [start, end) once the row above is done up to column end + lag, so that
+ * rows can depend on what the row above did up to that point. A worker only
+ * ever works on one row at a time, so at most nworkers rows are in progress.
+ * Returns -1 if it couldn't allocate the progress counters.
+ */
+int img_parallel_wave(int rows, int cols, int step, int lag, int nworkers, img_wave_func func, void *cls);
+
+#endif	/* IMAGO_THRPOOL_H_ */
@@ -0,0 +1,195 @@
+/* bigimg: checks that invalid and overflowing image dimensions (and views) are rejected,
+ * and, if there's enough free memory, that an image larger than 2GB can be
+ * allocated, converted and flipped, all the way to its last pixel.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include "imago2.h"
+
+#define BIG_SIZE	23200	/* 23200x23200 RGBA32 is just over 2GB */
+
+#define CHECK(x) \
+	do { \
+		if(!(x)) { \
+			printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #x); \
+			nfail++; \
+		} \
+	} while(0)
+
+static int nfail;
+
+static void test_rejects(void);
+static void test_big(void);
+static size_t avail_mem(void);
+static void set_sample(struct img_pixmap *img, int x, int y);
+static int check_sample(struct img_pixmap *img, int x, int y, int ximg, int yimg);
+
+static int samples[] = {0, 1, 2, BIG_SIZE / 2, BIG_SIZE - 2, BIG_SIZE - 1};
+#define NUM_SAMPLES	(int)(sizeof samples / sizeof *samples)
+
+
+int main(void)
+{
+	test_rejects();
+
+	if(sizeof(size_t) <= 4) {
+		printf("no 64bit address space, skipping the large image test\n");
+	} else if(avail_mem() < (size_t)BIG_SIZE * BIG_SIZE * 4 + (1u << 30)) {
+		printf("not enough free memory, skipping the large image test\n");
+	} else {
+		test_big();
+	}
+
+	printf("%d checks failed\n", nfail);
+	return nfail ? 1 : 0;
+}
+
+static void test_rejects(void)
+{
+	static unsigned char buf[64];
+	struct img_pixmap img, view;
+	FILE *fp;
+
+	img_init(&img);
+
+	/* negative dimensions */
+	CHECK(img_set_pixels(&img, -1, 10, IMG_FMT_RGBA32, 0) == -1);
+	CHECK(img_set_pixels(&img, 10, -1, IMG_FMT_RGBA32, 0) == -1);
+	/* the row size in bytes doesn't fit in an int */
+	CHECK(img_set_pixels(&img, INT_MAX / 4 + 1, 1, IMG_FMT_RGBA32, 0) == -1);
+	CHECK(img_set_pixels(&img, INT_MAX, 1, IMG_FMT_RGBAF, 0) == -1);
+	CHECK(img_wrap_pixels(&img, INT_MAX / 2, 1, IMG_FMT_RGB24, 0, buf, 0, 0) == -1);
+	/* pitch shorter than a row */
+	CHECK(img_set_pixels_pitch(&img, 16, 4, IMG_FMT_RGBA32, 63, 0) == -1);
+	CHECK(img_wrap_pixels(&img, 16, 1, IMG_FMT_RGBA32, 63, buf, 0, 0) == -1);
+	/* invalid pixel formats */
+	CHECK(img_set_pixels(&img, 4, 4, (enum img_fmt)NUM_IMG_FMT, 0) == -1);
+	CHECK(img_set_pixels(&img, 4, 4, (enum img_fmt)-1, 0) == -1);
+	CHECK(img_wrap_pixels(&img, 4, 4, (enum img_fmt)99, 0, buf, 0, 0) == -1);
+	/* the whole image doesn't fit in the address space */
+	if(sizeof(size_t) <= 4) {
+		CHECK(img_set_pixels(&img, 40000, 40000, IMG_FMT_RGBA32, 0) == -1);
+		CHECK(img_set_pixels_pitch(&img, 1, 3, IMG_FMT_GREY8, INT_MAX, 0) == -1);
+	}
+
+	/* saving invalid pixels shouldn't write anything */
+	remove("bigimg_reject.ppm");
+	CHECK(img_save_pixels("bigimg_reject.ppm", buf, -5, 3, IMG_FMT_RGB24) == -1);
+	CHECK(img_save_pixels("bigimg_reject.ppm", buf, 4, 4, (enum img_fmt)99) == -1);
+	if((fp = fopen("bigimg_reject.ppm", "rb"))) {
+		CHECK(!"bigimg_reject.ppm was written");
+		fclose(fp);
+		remove("bigimg_reject.ppm");
+	}
+
+	/* nothing above should have touched the pixmap */
+	CHECK(img.pixels == 0 && img.width == 0 && img.height == 0);
+
+	/* views of an image without pixels */
+	img_init(&view);
+	CHECK(img_view(&view, &img, 0, 0, 0, 0) == -1);
+
+	CHECK(img_set_pixels(&img, 4, 4, IMG_FMT_RGBA32, 0) == 0);
+	CHECK(img_convert(&img, (enum img_fmt)99) == -1);
+	CHECK(img.fmt == IMG_FMT_RGBA32);
+
+	/* views past the edges, including ones where x + w overflows */
+	CHECK(img_view(&view, &img, 1, 1, INT_MAX, 1) == -1);
+	CHECK(img_view(&view, &img, 1, 1, 1, INT_MAX) == -1);
+	CHECK(img_view(&view, &img, INT_MAX, 0, 1, 1) == -1);
+	CHECK(img_view(&view, &img, 2, 0, 3, 4) == -1);
+	CHECK(view.pixels == 0);
+	CHECK(img_view(&view, &img, 1, 1, 3, 3) == 0);
+	CHECK(img_view(&view, &img, 4, 4, 0, 0) == 0);
+
+	img_destroy(&view);
+	img_destroy(&img);
+}
+
+static void test_big(void)
+{
+	int i, j;
+	struct img_pixmap img;
+
+	printf("allocating a %dx%d RGBA32 image (%lu bytes)\n", BIG_SIZE, BIG_SIZE,
+			(unsigned long)BIG_SIZE * BIG_SIZE * 4);
+
+	img_init(&img);
+	if(img_set_pixels(&img, BIG_SIZE, BIG_SIZE, IMG_FMT_RGBA32, 0) == -1) {
+		printf("failed to allocate the large image\n");
+		nfail++;
+		return;
+	}
+	CHECK(img.pitch == BIG_SIZE * 4);
+
+	for(i=0; i<NUM_SAMPLES; i++) {
+		for(j=0; j<NUM_SAMPLES; j++) {
+			set_sample(&img, samples[j], samples[i]);
+		}
+	}
+
+	/* same size conversion, in place */
+	CHECK(img_convert(&img, IMG_FMT_BGRA32) == 0);
+	/* upside down */
+	img_vflip(&img);
+	/* shrinking conversion */
+	CHECK(img_convert(&img, IMG_FMT_RGB24) == 0);
+	CHECK(img.pitch == BIG_SIZE * 3);
+
+	for(i=0; i<NUM_SAMPLES; i++) {
+		for(j=0; j<NUM_SAMPLES; j++) {
+			CHECK(check_sample(&img, samples[j], samples[i], samples[j], BIG_SIZE - 1 - samples[i]));
+		}
+	}
+	img_destroy(&img);
+}
+
+static size_t avail_mem(void)
+{
+	FILE *fp;
+	char buf[256];
+	unsigned long kb;
+
+	/* prefer MemAvailable, which counts caches that can be dropped */
+	if((fp = fopen("/proc/meminfo", "r"))) {
+		while(fgets(buf, sizeof buf, fp)) {
+			if(sscanf(buf, "MemAvailable: %lu kB", &kb) == 1) {
+				fclose(fp);
+				return (size_t)kb * 1024;
+			}
+		}
+		fclose(fp);
+	}
+#ifdef _SC_AVPHYS_PAGES
+	return (size_t)sysconf(_SC_AVPHYS_PAGES) * (size_t)sysconf(_SC_PAGESIZE);
+#else
+	return 0;
+#endif
+}
+
+/* every sample pixel gets a color from its coordinates */
+#define SAMPLE_R(x, y)	(((x) * 7 + (y)) & 0xff)
+#define SAMPLE_G(x, y)	(((x) + (y) * 5) & 0xff)
+#define SAMPLE_B(x, y)	(((x) ^ (y)) & 0xff)
+
+static void set_sample(struct img_pixmap *img, int x, int y)
+{
+	unsigned char *pix = (unsigned char*)img->pixels + (size_t)y * img->pitch + (size_t)x * 4;
+
+	pix[0] = SAMPLE_R(x, y);
+	pix[1] = SAMPLE_G(x, y);
+	pix[2] = SAMPLE_B(x, y);
+	pix[3] = 0xff;
+}
+
+/* checks that the sample set at (x, y) is at (ximg, yimg) */
+static int check_sample(struct img_pixmap *img, int x, int y, int ximg, int yimg)
+{
+	unsigned char *pix = (unsigned char*)img->pixels + (size_t)yimg * img->pitch +
+		(size_t)ximg * img->pixelsz;
+
+	return pix[0] == SAMPLE_R(x, y) && pix[1] == SAMPLE_G(x, y) && pix[2] == SAMPLE_B(x, y);
+}
@@ -0,0 +1,161 @@
+/* convsimd: checks that every pixel format conversion gives bit-identical
+ * results with and without the SIMD kernels, for each instruction set level the
+ * CPU supports, on images of all sorts of widths (to exercise the leftover
+ * pixels), and on float values that need care: out of range, infinite, NaN, and
+ * exactly halfway between two byte values.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "imago2.h"
+#include "conv.h"
+
+static const char *fmtname[] = {
+	"grey8", "rgb24", "rgba32", "greyf", "rgbf", "rgbaf", "bgra32", "rgb565", "idx8"
+};
+
+/* instruction set levels of img_use_simd: SSE2, SSSE3, AVX2 (or just NEON) */
+#define MAX_SIMD_LEVEL	3
+
+static int widths[] = {1, 2, 3, 5, 7, 8, 15, 16, 17, 31, 32, 33, 63, 64, 65, 127, 300, 0};
+
+static int gen_image(struct img_pixmap *img, int w, int h, enum img_fmt fmt, unsigned int seed);
+static float rand_float(void);
+static int same_pixels(struct img_pixmap *a, struct img_pixmap *b);
+
+
+int main(void)
+{
+	int i, j, k, w, h, level, nsimd, nfail = 0, ntests = 0;
+	struct img_pixmap a, b;
+
+	for(level=1; level<=MAX_SIMD_LEVEL; level++) {
+		nsimd = 0;
+
+		for(i=0; i<NUM_IMG_FMT; i++) {
+			for(j=0; j<NUM_IMG_FMT; j++) {
+				if(i == j || j == IMG_FMT_IDX8) continue;
+
+				img_use_simd(level);
+				if(!img_conv_simd(i, j)) continue;
+				nsimd++;
+
+				for(k=0; widths[k]; k++) {
+					w = widths[k];
+					h = w == 300 ? 300 : 3;	/* 300x300 is converted in multiple bands */
+
+					img_init(&a);
+					img_init(&b);
+					if(gen_image(&a, w, h, i, k) == -1 || gen_image(&b, w, h, i, k) == -1) {
+						fprintf(stderr, "failed to create test image\n");
+						return 1;
+					}
+
+					img_use_simd(level);
+					if(img_convert(&a, j) == -1) {
+						fprintf(stderr, "failed to convert %s -> %s\n", fmtname[i], fmtname[j]);
+						return 1;
+					}
+					img_use_simd(0);
+					if(img_convert(&b, j) == -1) {
+						fprintf(stderr, "failed to convert %s -> %s\n", fmtname[i], fmtname[j]);
+						return 1;
+					}
+
+					if(!same_pixels(&a, &b)) {
+						printf("%s -> %s, %dx%d, SIMD level %d: SIMD and scalar results differ\n",
+								fmtname[i], fmtname[j], w, h, level);
+						nfail++;
+					}
+					ntests++;
+					img_destroy(&a);
+					img_destroy(&b);
+				}
+			}
+		}
+		printf("SIMD level %d: %d format pairs with SIMD kernels\n", level, nsimd);
+	}
+	img_use_simd(-1);
+
+	printf("%d conversions checked against the scalar kernels, %d failed\n", ntests, nfail);
+	return nfail ? 1 : 0;
+}
+
+static int gen_image(struct img_pixmap *img, int w, int h, enum img_fmt fmt, unsigned int seed)
+{
+	int i, j, nval;
+	unsigned char *row;
+	float *frow;
+	struct img_colormap *cmap;
+
+	if(img_set_pixels(img, w, h, fmt, 0) == -1) {
+		return -1;
+	}
+	srand(seed);
+
+	for(i=0; i<h; i++) {
+		row = (unsigned char*)img->pixels + (size_t)i * img->pitch;
+		if(img_is_float(img)) {
+			frow = (float*)row;
+			nval = w * img->pixelsz / sizeof(float);
+			for(j=0; j<nval; j++) {
+				frow[j] = rand_float();
+			}
+		} else {
+			for(j=0; j<w * img->pixelsz; j++) {
+				row[j] = rand();
+			}
+		}
+	}
+
+	if(fmt == IMG_FMT_IDX8) {
+		/* leave some indices past the end of the colormap */
+		cmap = img_colormap(img);
+		cmap->ncolors = 200;
+		for(i=0; i<256; i++) {
+			cmap->color[i].r = rand();
+			cmap->color[i].g = rand();
+			cmap->color[i].b = rand();
+			cmap->alpha[i] = rand();
+		}
+	}
+	return 0;
+}
+
+static float rand_float(void)
+{
+	switch(rand() % 16) {
+	case 0:
+		return -(float)rand() / RAND_MAX;
+	case 1:
+		return 1.0f + (float)rand() / RAND_MAX;
+	case 2:
+		return (rand() & 1) ? HUGE_VAL : -HUGE_VAL;
+	case 3:
+		return (rand() & 1) ? sqrt(-1.0) : -0.0f;
+	case 4:
+		return ((rand() & 0xff) + 0.5f) / 255.0f;	/* rounding ties */
+	case 5:
+		return (float)(rand() & 0xff) / 255.0f;
+	default:
+		break;
+	}
+	return (float)rand() / RAND_MAX;
+}
+
+static int same_pixels(struct img_pixmap *a, struct img_pixmap *b)
+{
+	int i;
+
+	if(a->fmt != b->fmt || a->width != b->width || a->height != b->height) {
+		return 0;
+	}
+	for(i=0; i<a->height; i++) {
+		if(memcmp((char*)a->pixels + (size_t)i * a->pitch, (char*)b->pixels + (size_t)i * b->pitch,
+					a->width * a->pixelsz) != 0) {
+			return 0;
+		}
+	}
+	return 1;
+}
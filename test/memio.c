@@ -0,0 +1,102 @@
+/* memio: checks that img_read_mem detects formats from the data, and falls back
+ * to the pixmap name for TGA data without a footer, which it can't detect.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "imago2.h"
+
+#define CHECK(x) \
+	do { \
+		if(!(x)) { \
+			printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #x); \
+			nfail++; \
+		} \
+	} while(0)
+
+#define WIDTH	5
+#define HEIGHT	3
+
+static int nfail;
+
+static void test_ppm(void);
+static void test_tga(void);
+static int check_pixels(struct img_pixmap *img);
+
+/* pixel i has the value i * 7 in all three channels */
+#define PIXVAL(i)	((i) * 7)
+
+
+int main(void)
+{
+	test_ppm();
+	test_tga();
+
+	printf("%d checks failed\n", nfail);
+	return nfail ? 1 : 0;
+}
+
+static void test_ppm(void)
+{
+	int i;
+	unsigned char buf[64], *pix;
+	struct img_pixmap img;
+
+	i = sprintf((char*)buf, "P6\n%d %d\n255\n", WIDTH, HEIGHT);
+	pix = buf + i;
+	for(i=0; i<WIDTH * HEIGHT * 3; i++) {
+		*pix++ = PIXVAL(i / 3);
+	}
+
+	img_init(&img);
+	CHECK(img_read_mem(&img, buf, pix - buf) == 0);
+	CHECK(check_pixels(&img));
+	img_destroy(&img);
+}
+
+/* an uncompressed true color TGA, top to bottom, without the footer */
+static void test_tga(void)
+{
+	int i;
+	unsigned char buf[18 + WIDTH * HEIGHT * 3], *pix;
+	struct img_pixmap img;
+
+	memset(buf, 0, 18);
+	buf[2] = 2;				/* uncompressed true color */
+	buf[12] = WIDTH;
+	buf[14] = HEIGHT;
+	buf[16] = 24;			/* bits per pixel */
+	buf[17] = 0x20;			/* origin: top-left */
+	pix = buf + 18;
+	for(i=0; i<WIDTH * HEIGHT * 3; i++) {
+		*pix++ = PIXVAL(i / 3);
+	}
+
+	img_init(&img);
+	/* without a name there's nothing to go by */
+	CHECK(img_read_mem(&img, buf, sizeof buf) == -1);
+
+	img_set_name(&img, ".tga");
+	CHECK(img_read_mem(&img, buf, sizeof buf) == 0);
+	CHECK(check_pixels(&img));
+	img_destroy(&img);
+}
+
+static int check_pixels(struct img_pixmap *img)
+{
+	int i, j;
+	unsigned char *pix;
+
+	if(img->fmt != IMG_FMT_RGB24 || img->width != WIDTH || img->height != HEIGHT) {
+		return 0;
+	}
+	for(i=0; i<HEIGHT; i++) {
+		pix = (unsigned char*)img->pixels + (size_t)i * img->pitch;
+		for(j=0; j<WIDTH * 3; j++) {
+			if(pix[j] != PIXVAL(i * WIDTH + j / 3)) {
+				return 0;
+			}
+		}
+	}
+	return 1;
+}
@@ -0,0 +1,102 @@
+/* quant: checks that quantizing an image fills in the whole colormap, leaving
+ * the entries past ncolors black and opaque, so that the same image always
+ * quantizes to the same bytes.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "imago2.h"
+
+#define CHECK(x) \
+	do { \
+		if(!(x)) { \
+			printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #x); \
+			nfail++; \
+		} \
+	} while(0)
+
+static int nfail;
+
+static int quantize(struct img_pixmap *img, int maxcol, enum img_dither dither);
+static void dirty_stack(void);
+static int unused_clear(struct img_colormap *cmap);
+
+
+int main(void)
+{
+	int i;
+	struct img_pixmap a, b;
+	static const enum img_dither dither[] = {IMG_DITHER_NONE, IMG_DITHER_ORDERED, IMG_DITHER_FLOYD_STEINBERG};
+
+	for(i=0; i<3; i++) {
+		img_init(&a);
+		img_init(&b);
+		if(quantize(&a, 16, dither[i]) == -1) {
+			return 1;
+		}
+		dirty_stack();
+		if(quantize(&b, 16, dither[i]) == -1) {
+			return 1;
+		}
+
+		CHECK(img_colormap(&a)->ncolors <= 16);
+		CHECK(unused_clear(img_colormap(&a)));
+		CHECK(memcmp(img_colormap(&a), img_colormap(&b), sizeof(struct img_colormap)) == 0);
+		CHECK(memcmp(a.pixels, b.pixels, (size_t)a.height * a.pitch) == 0);
+
+		img_destroy(&a);
+		img_destroy(&b);
+	}
+
+	printf("%d checks failed\n", nfail);
+	return nfail ? 1 : 0;
+}
+
+/* quantizes a 64x64 gradient with a few colors */
+static int quantize(struct img_pixmap *img, int maxcol, enum img_dither dither)
+{
+	int i, j;
+	unsigned char *pix;
+
+	if(img_set_pixels(img, 64, 64, IMG_FMT_RGB24, 0) == -1) {
+		fprintf(stderr, "failed to create test image\n");
+		return -1;
+	}
+	pix = img->pixels;
+	for(i=0; i<64; i++) {
+		for(j=0; j<64; j++) {
+			*pix++ = j * 4;
+			*pix++ = i * 4;
+			*pix++ = (i ^ j) * 4;
+		}
+	}
+
+	if(img_quantize(img, maxcol, dither) == -1) {
+		fprintf(stderr, "failed to quantize test image\n");
+		return -1;
+	}
+	return 0;
+}
+
+/* leaves junk where img_quantize keeps its temporary colormap */
+static void dirty_stack(void)
+{
+	volatile unsigned char buf[4096];
+	int i;
+
+	for(i=0; i<(int)sizeof buf; i++) {
+		buf[i] = i * 37 + 11;
+	}
+}
+
+static int unused_clear(struct img_colormap *cmap)
+{
+	int i;
+
+	for(i=cmap->ncolors; i<256; i++) {
+		if(cmap->color[i].r || cmap->color[i].g || cmap->color[i].b || cmap->alpha[i] != 255) {
+			return 0;
+		}
+	}
+	return 1;
+}